@@ -1,20 +1,61 @@
+#include <limits.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 	
 #include "ai.h"
+#include "book.h"
+#include "evalcache.h"
+#include "field.h"
 #include "hidamari.h"
+#include "mlp.h"
+#include "pc.h"
 #include "region.h"
+#include "rollout.h"
+#include "telemetry.h"
+
+#define LEN(a) (sizeof(a) / sizeof(*(a)))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define PLAN_DEPTH 1
 #define DEPTH 2
 
-void
-field_init(HidamariPlayField *field);
+/* Rounding may leave a leaf scored a hair below the bound on its exact
+ * score, so bounds are lowered by this fraction */
+#define BOUND_SLACK 1e-9
 
-int
-field_update(HidamariPlayField *field, Button act);
+/* Each node branches on 3 orientations, shifted by up to SHIFTS columns to
+ * either side, so that every column of the board is reached */
+#define SHIFTS (HIDAMARI_WIDTH / 2)
+#define BRANCH (3 * 2 * SHIFTS)
+
+/* Number of distinct (x, y, orientation) places a hidamari can be in. The
+ * x position of a hidamari may be up to two columns left of the grid. */
+#define PATH_PLACES (4 * HIDAMARI_HEIGHT * (HIDAMARI_WIDTH + 2))
+/* Values of the 4-bit lock timer */
+#define PATH_SLIDES 16
+/* Number of distinct states of the input path search: a place, the lock
+ * timer, and the gravity timer, which only depends on the frame and so
+ * takes one of HIDAMARI_PLAN_MAX values */
+#define PATH_STATES (PATH_PLACES * PATH_SLIDES * HIDAMARI_PLAN_MAX)
+/* Most states the input path search keeps. Far fewer are reached, as the
+ * lock timer only runs on the ground and the gravity timer follows the
+ * frame; a search that would need more gives up. */
+#define PATH_NODES (PATH_PLACES * HIDAMARI_PLAN_MAX)
+
+/* A hidamari state visited by the input path search. The rest of the
+ * playfield is the same for all of them. */
+typedef struct {
+	Hidamari current;
+	f32 gravity_timer;
+	u8 slide_timer;
+	u8 frame; /* Inputs from the initial state */
+	Button act;
+	u32 parent;
+} PathNode;
 
 /* Allocate a new node with a copy of _init_ as its state */
 FieldNode *
@@ -26,6 +67,7 @@ create_node(void *region, HidamariPlayField const *init)
 	if (!ret)
 		return NULL;
 	memset(ret, 0, sizeof(*ret));
+	ret->bound = -INFINITY;
 	memcpy(&ret->field, init, sizeof(HidamariPlayField));
 	return ret;
 }
@@ -47,38 +89,205 @@ derive(void *region, FieldNode **stackp, FieldNode *parent,
 	child->parent = parent;
 	child->g = parent->g + 1;
 	for (i = 0; i < n_action; ++i) {
-		field_update(&child->field, action[i]);
+		if (field_move(&child->field, action[i])) {
+			child->placed = child->field.current;
+			if (HIDAMARI_GS_GAME_OVER == field_lock(&child->field))
+				child->dead = true;
+		}
 	}
 	child->next = *stackp;
 	*stackp = child;
 	return 0;
 }
 
-/* Expands a fieldnode by branching out on all possible permutations of the
- * current hidamari.
+/* The surface of a stack: the top filled row of every column, the floor
+ * being row 0, and the highest of them */
+typedef struct {
+	int height[HIDAMARI_WIDTH];
+	int top;
+} Surface;
+
+/* Where one input sequence of ai_expand() leaves the hidamari on an empty
+ * board, just before it locks */
+typedef struct {
+	Hidamari t;
+	f32 gravity_timer;
+} Outcome;
+
+/* The outcomes of every input sequence for a hidamari starting in the
+ * same state. They hold on any board whose stack the hidamari cannot
+ * reach before the hard drop, so expansions of such boards share them. */
+typedef struct {
+	bool valid;
+	Hidamari current;
+	f32 gravity_timer;
+	u8 level;
+	Outcome out[BRANCH];
+} Expansion;
+
+/* Expansions are kept per thread for the life of the process, indexed by
+ * the state of the hidamari */
+#define EXPANSION_CACHE 32
+
+static _Thread_local Expansion expansion_cache[EXPANSION_CACHE];
+
+/* Read the surface from the top down, stopping at the lowest column top
+ * so that nothing buried deeper is looked at */
+static void
+surface(HidamariPlayField const *field, Surface *s)
+{
+	int y;
+	HidamariRow bits, covered = 0;
+
+	memset(s->height, 0, sizeof(s->height));
+	s->top = 0;
+	for (y = HIDAMARI_HEIGHT - 1;
+	     y > 0 && HIDAMARI_ROW_INNER != covered; --y) {
+		bits = field->grid[y] & HIDAMARI_ROW_INNER & ~covered;
+		if (bits && 0 == covered)
+			s->top = y;
+		for (; bits; bits &= bits - 1)
+			s->height[row_ctz(bits)] = y;
+		covered |= field->grid[y] & HIDAMARI_ROW_INNER;
+	}
+}
+
+/* Write the inputs of one child of an expansion, _i_ rotations then _j_ shifts
+ * in the direction _dir_ and a hard drop */
+static size_t
+inputs(Button *action, size_t i, size_t j, Button dir)
+{
+	memset(action, BUTTON_R, i);
+	memset(action + i, dir, j);
+	action[i + j] = BUTTON_B;
+	return i + j + 1;
+}
+
+static bool
+same_start(Expansion const *e, HidamariPlayField const *field)
+{
+	return e->current.shape == field->current.shape
+		&& e->current.orientation == field->current.orientation
+		&& e->current.pos.x == field->current.pos.x
+		&& e->current.pos.y == field->current.pos.y
+		&& e->gravity_timer == field->gravity_timer
+		&& e->level == field->level;
+}
+
+/* Look up the outcomes for the hidamari of _field_, playing every input
+ * sequence on an empty board if they are not cached yet.
  *
- * Returns 0 if successful, or -1 if it runs out of memory.
+ * Return: The expansion, or NULL if the hidamari locks before the hard
+ *	drop even on an empty board.
  */
+static Expansion const *
+expansion(HidamariPlayField const *field)
+{
+	size_t i, j, k, n, y, len, slot;
+	u32 timer;
+	Button action[3 + SHIFTS];
+	Button const dir[2] = {BUTTON_RIGHT, BUTTON_LEFT};
+	HidamariPlayField empty, tmp;
+	Expansion *e;
+
+	memcpy(&timer, &field->gravity_timer, sizeof(timer));
+	slot = (field->current.shape + 7 * (field->current.orientation
+			+ 4 * (field->current.pos.x + HIDAMARI_WIDTH
+			* (field->current.pos.y + field->level + timer))))
+		% EXPANSION_CACHE;
+	e = &expansion_cache[slot];
+	if (same_start(e, field))
+		return e->valid ? e : NULL;
+	e->current = field->current;
+	e->gravity_timer = field->gravity_timer;
+	e->level = field->level;
+	e->valid = true;
+	memcpy(&empty, field, sizeof(empty));
+	empty.grid[0] = HIDAMARI_ROW_FULL;
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		empty.grid[y] = HIDAMARI_ROW_WALLS;
+	}
+	k = 0;
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < SHIFTS; ++j) {
+			for (n = 0; n < 2; ++n, ++k) {
+				memcpy(&tmp, &empty, sizeof(tmp));
+				len = inputs(action, i, j, dir[n]);
+				for (y = 0; y < len; ++y) {
+					if (field_move(&tmp, action[y]))
+						break;
+				}
+				/* Only the hard drop may lock it */
+				if (y != len - 1)
+					e->valid = false;
+				e->out[k].t = tmp.current;
+				e->out[k].gravity_timer = tmp.gravity_timer;
+			}
+		}
+	}
+	return e->valid ? e : NULL;
+}
+
+/* Derive the child of _parent_ that ends up as _o_, dropping it straight
+ * onto the surface _s_ instead of playing its inputs */
+static int
+drop(void *region, FieldNode **stackp, FieldNode *parent, Surface const *s,
+		Outcome const *o, size_t n_action, Button *action)
+{
+	int i, d = INT_MAX;
+	Vec2 cell[4];
+	FieldNode *child = create_node(region, &parent->field);
+
+	if (!child)
+		return -1;
+	child->n_action = n_action;
+	child->action = action;
+	child->parent = parent;
+	child->g = parent->g + 1;
+	field_cells(&o->t, cell);
+	for (i = 0; i < 4; ++i) {
+		d = MIN(d, cell[i].y - s->height[cell[i].x] - 1);
+	}
+	child->field.current = o->t;
+	child->field.current.pos.y -= d;
+	child->field.gravity_timer = o->gravity_timer;
+	child->placed = child->field.current;
+	if (HIDAMARI_GS_GAME_OVER == field_lock(&child->field))
+		child->dead = true;
+	child->next = *stackp;
+	*stackp = child;
+	return 0;
+}
+
 int
-expand(void *region, FieldNode **stackp, FieldNode *parent)
+ai_expand(void *region, FieldNode **stackp, FieldNode *parent)
 {
-	size_t i, j;
+	size_t i, j, k, n, len;
 	Button *tmp;
+	Button const dir[2] = {BUTTON_RIGHT, BUTTON_LEFT};
+	Surface s;
+	Expansion const *e = NULL;
 
+	/* While the inputs play out well above the stack, only its surface
+	 * decides where each hidamari lands. An input sequence sinks the
+	 * hidamari by at most a row per input, and its lowest cell starts at
+	 * most 3 rows below its position. */
+	surface(&parent->field, &s);
+	if (s.top + SHIFTS + 5 < parent->field.current.pos.y)
+		e = expansion(&parent->field);
+	k = 0;
 	for (i = 0; i < 3; ++i) {
-		for (j = 0; j < 6; ++j) {
-			tmp = region_alloc(region, i + j + 1);
-			memset(tmp, BUTTON_R, i);
-			memset(tmp + i, BUTTON_RIGHT, j);
-			tmp[i + j] = BUTTON_B;
-			if (0 > derive(region, stackp, parent, i + j + 1, tmp))
-				return -1;
-			tmp = region_alloc(region, i + j + 1);
-			memset(tmp, BUTTON_R, i);
-			memset(tmp + i, BUTTON_LEFT, j);
-			tmp[i + j] = BUTTON_B;
-			if (0 > derive(region, stackp, parent, i + j + 1, tmp))
-				return -1;
+		for (j = 0; j < SHIFTS; ++j) {
+			for (n = 0; n < 2; ++n, ++k) {
+				tmp = region_alloc(region, i + j + 1);
+				if (!tmp)
+					return -1;
+				len = inputs(tmp, i, j, dir[n]);
+				if (e ? 0 > drop(region, stackp, parent, &s,
+						&e->out[k], len, tmp)
+				    : 0 > derive(region, stackp, parent, len, tmp))
+					return -1;
+			}
 		}
 	}
 	return 0;
@@ -88,86 +297,219 @@ expand(void *region, FieldNode **stackp, FieldNode *parent)
  * Heuristics to evaluate how good a state is.
  */
 
-/* Heuristic 1: Calculate the aggregate difference in height between all
- * columns.
- */
-static int
-h1(HidamariPlayField *field)
+void
+ai_features(HidamariPlayField const *field, HidamariPlayField const *prev,
+		Hidamari const *placed, size_t n, double f[HIDAMARI_FEATURE_LAST])
 {
-	int top;
-	size_t i, j;
-	int score = 0;
-	int heights[10];
-
-	for (i = 0; i < HIDAMARI_WIDTH - 1; ++i) {
-		for (j = 0; j < HIDAMARI_HEIGHT; ++j) {
-			if ((field->grid[j] & (2 << i)) == (2 << i)) {
-				top = j;
-			}
+	int x, y;
+	int i;
+	HidamariRow row, inner, bits;
+	HidamariRow covered = 0;
+	HidamariRow well, well_prev = 0;
+	int height[HIDAMARI_WIDTH] = {0};
+	int run[HIDAMARI_WIDTH] = {0};
+	int holes = 0, wells = 0;
+	int row_trans = 0, col_trans = 0;
+	int bumpiness = 0, aggregate = 0;
+	int full, cleared, ymin, ymax;
+	Vec2 cell[4];
+
+	/* Walk the grid once from the top down, gathering every feature of
+	 * the stack as bit operations on whole rows. */
+	for (y = HIDAMARI_HEIGHT - 1; y > 0; --y) {
+		row = field->grid[y];
+		inner = row & HIDAMARI_ROW_INNER;
+		holes += row_popcount(~row & covered);
+		for (bits = inner & ~covered; bits; bits &= bits - 1)
+			height[row_ctz(bits)] = y;
+		row_trans += row_popcount((row ^ (row >> 1))
+				& (HIDAMARI_ROW_FULL >> 1));
+		col_trans += row_popcount((row ^ field->grid[y - 1])
+				& HIDAMARI_ROW_INNER);
+		well = ~row & (row << 1) & (row >> 1) & HIDAMARI_ROW_INNER;
+		for (bits = well; bits; bits &= bits - 1) {
+			x = row_ctz(bits);
+			run[x] += 1;
+			wells += run[x];
 		}
-		heights[i] = top;
+		for (bits = well_prev & ~well; bits; bits &= bits - 1)
+			run[row_ctz(bits)] = 0;
+		well_prev = well;
+		covered |= inner;
 	}
-	for (i = 0; i < 9; ++i) {
-		score += abs(heights[i] - heights[i + 1]);
+	for (x = 1; x < HIDAMARI_WIDTH - 1; ++x) {
+		aggregate += height[x];
+		if (x < HIDAMARI_WIDTH - 2)
+			bumpiness += abs(height[x] - height[x + 1]);
 	}
-	return score;
+	f[HIDAMARI_FEATURE_BUMPINESS] = bumpiness;
+	f[HIDAMARI_FEATURE_HEIGHT] = aggregate;
+	f[HIDAMARI_FEATURE_HOLES] = holes;
+	f[HIDAMARI_FEATURE_WELLS] = wells;
+	f[HIDAMARI_FEATURE_ROW_TRANSITIONS] = row_trans;
+	f[HIDAMARI_FEATURE_COL_TRANSITIONS] = col_trans;
+	f[HIDAMARI_FEATURE_ERODED] = 0;
+	f[HIDAMARI_FEATURE_LANDING_HEIGHT] = 0;
+	if (n <= HIDAMARI_FEATURE_ERODED || !prev || !placed)
+		return;
+
+	/* The remaining features describe the placement that led here */
+	field_cells(placed, cell);
+	full = 0;
+	ymin = ymax = cell[0].y;
+	for (i = 0; i < 4; ++i) {
+		row = prev->grid[cell[i].y];
+		for (x = 0; x < 4; ++x) {
+			if (cell[x].y == cell[i].y)
+				row |= (HidamariRow)1 << cell[x].x;
+		}
+		if (HIDAMARI_ROW_INNER == (row & HIDAMARI_ROW_INNER))
+			full += 1;
+		ymin = MIN(ymin, cell[i].y);
+		ymax = MAX(ymax, cell[i].y);
+	}
+	cleared = field->lines - prev->lines;
+	f[HIDAMARI_FEATURE_ERODED] = cleared * full;
+	f[HIDAMARI_FEATURE_LANDING_HEIGHT] = (ymin + ymax) / 2.0;
 }
 
-/* Heuristic 2: Calculate the aggregate height of all columns. */
-static int
-h2(HidamariPlayField *field)
+static double
+weigh(double const f[HIDAMARI_FEATURE_LAST], HidamariAIConfig const *config)
 {
-	int top;
-	size_t i, j;
-	int score = 0;
+	size_t i;
+	double score = 0;
 
-	for (i = 2; i < (1 << (HIDAMARI_WIDTH - 1)); i <<= 1) {
-		for (j = 0; j < HIDAMARI_HEIGHT; ++j) {
-			if ((field->grid[j] & i) == i) {
-				top = j;
-			}
-		}
-		score += top;
+	for (i = 0; i < config->n_weight; ++i) {
+		score += config->weight[i] * f[i];
 	}
 	return score;
 }
 
-/* Heuristic 3: Calculate the number of holes on the field. A hole is defined
- * as any open space with a filled space above it in the same column.
+/* Main evaluation function for a given state. Each of the features
+ * is multiplied by a certain weight depending on how valuable it is deemed.
  */
-static int
-h3(HidamariPlayField *field)
-{
-	int cnt;
-	size_t i, j;
-	int score = 0;
-
-	for (i = 0; i < HIDAMARI_WIDTH - 1; ++i) {
-		cnt = 0;
-		for (j = 0; j < HIDAMARI_HEIGHT; ++j) {
-			if ((field->grid[j] & (2 << i)) == (2 << i)) {
-				score += cnt;
-				cnt = 0;
-			} else {
-				cnt += 1;
-			}
-		}
-	}
-	return score;
+static double
+evaluate(FieldNode const *node, HidamariAIConfig const *config)
+{
+	double f[HIDAMARI_FEATURE_LAST];
+
+	ai_features(&node->field, node->parent ? &node->parent->field : NULL,
+			&node->placed, config->n_weight, f);
+	return weigh(f, config);
 }
 
-/* Main evaluation function for a given state. Each of the heuristics
- * is multiplied by a certain weight depending on how valuable it is deemed.
+/* Lower bound on the score of placing one more hidamari onto _field_,
+ * whose features are _f_, or -INFINITY if there is none to be had.
+ *
+ * While no line can be cleared and the stack is out of reach of the moves
+ * made before a hard drop, the hidamari lands on top of the stack: holes
+ * and column transitions can only be added, each of its four cells raises
+ * its column, and it lands above the lowest column. Every row keeps its
+ * two walls apart. Bumpiness and wells can fall to nothing, except that
+ * each cell of height gained levels at most two columns of bumpiness.
  */
-static int
-evaluate(HidamariPlayField *field, double weight[3])
+static double
+leaf_bound(HidamariPlayField const *field, double const f[HIDAMARI_FEATURE_LAST],
+		HidamariAIConfig const *config)
 {
-	int score = 0;
+	int y, top = 0, low = 0;
+	size_t i;
+	HidamariRow row, open, covered = 0;
+	double lo[HIDAMARI_FEATURE_LAST], hi[HIDAMARI_FEATURE_LAST];
+	double w, v, d, score = 0;
 
-	score += weight[0] * h1(field);
-	score += weight[1] * h2(field);
-	score += weight[2] * h3(field);
-	return score;
+	for (y = HIDAMARI_HEIGHT - 1; y > 0; --y) {
+		row = field->grid[y] & HIDAMARI_ROW_INNER;
+		open = ~row & HIDAMARI_ROW_INNER;
+		/* A row is only ever completed through its uncovered cells */
+		if (row_popcount(open) <= 4 && !(open & covered))
+			return -INFINITY;
+		if (!top && row)
+			top = y;
+		covered |= row;
+		if (!low && HIDAMARI_ROW_INNER == covered)
+			low = y;
+	}
+	/* The hidamari spawns with its cells up to three rows down, and
+	 * gravity pulls it down at most a row for each of the SHIFTS + 1
+	 * moves before it is dropped */
+	if (top + SHIFTS + 5 >= HIDAMARI_HEIGHT)
+		return -INFINITY;
+
+	for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+		lo[i] = 0;
+		hi[i] = INFINITY;
+	}
+	lo[HIDAMARI_FEATURE_HEIGHT] = f[HIDAMARI_FEATURE_HEIGHT] + 4;
+	lo[HIDAMARI_FEATURE_HOLES] = f[HIDAMARI_FEATURE_HOLES];
+	lo[HIDAMARI_FEATURE_ROW_TRANSITIONS] = 2 * (HIDAMARI_HEIGHT - 1);
+	lo[HIDAMARI_FEATURE_COL_TRANSITIONS] = f[HIDAMARI_FEATURE_COL_TRANSITIONS];
+	hi[HIDAMARI_FEATURE_ERODED] = 0;
+	lo[HIDAMARI_FEATURE_LANDING_HEIGHT] = low + 1;
+
+	i = 0;
+	if (config->n_weight > HIDAMARI_FEATURE_HEIGHT
+	    && config->weight[HIDAMARI_FEATURE_BUMPINESS] > 0
+	    && config->weight[HIDAMARI_FEATURE_HEIGHT] > 0) {
+		/* Raising the aggregate height by d >= 4 takes up to 2d off
+		 * the bumpiness, so the least score is at either end */
+		w = config->weight[HIDAMARI_FEATURE_BUMPINESS];
+		d = MAX(4, f[HIDAMARI_FEATURE_BUMPINESS] / 2);
+		score = config->weight[HIDAMARI_FEATURE_HEIGHT]
+			* (f[HIDAMARI_FEATURE_HEIGHT] + 4)
+			+ w * MAX(0, f[HIDAMARI_FEATURE_BUMPINESS] - 8);
+		score = MIN(score, config->weight[HIDAMARI_FEATURE_HEIGHT]
+				* (f[HIDAMARI_FEATURE_HEIGHT] + d)
+				+ w * MAX(0, f[HIDAMARI_FEATURE_BUMPINESS] - 2 * d));
+		i = HIDAMARI_FEATURE_HEIGHT + 1;
+	}
+	for (; i < config->n_weight; ++i) {
+		w = config->weight[i];
+		if (0 == w)
+			continue;
+		v = w > 0 ? lo[i] : hi[i];
+		if (isinf(v))
+			return -INFINITY;
+		score += w * v;
+	}
+	return score - BOUND_SLACK * fabs(score);
+}
+
+int
+ai_config_load(HidamariAIConfig *config, char const *path)
+{
+	FILE *fp;
+	char book[256];
+	char mlp[256];
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	memset(config, 0, sizeof(*config));
+	while (config->n_weight < HIDAMARI_FEATURE_LAST
+	    && 1 == fscanf(fp, "%lf", &config->weight[config->n_weight]))
+		config->n_weight += 1;
+	if (2 > fscanf(fp, " playouts %u %u %u", &config->n_playout,
+			&config->playout_depth, &config->n_thread))
+		config->n_playout = 0;
+	if (1 == fscanf(fp, " book %255s", book)) {
+		config->book = book_open(book);
+		if (!config->book) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	if (1 == fscanf(fp, " mlp %255s", mlp)) {
+		config->mlp = mlp_open(mlp);
+		if (!config->mlp) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	if (1 != fscanf(fp, " clear %u", &config->pc_pieces))
+		config->pc_pieces = 0;
+	fclose(fp);
+	return 0 == config->n_weight ? -1 : 0;
 }
 
 /*
@@ -188,10 +530,10 @@ mkplan(void *region, FieldNode *goal)
 	size_t n_move = 0;
 	size_t i;
 
-	/* Move up the tree to the node where the plan will begin to be made */
-	for (i = 0; i < DEPTH - PLAN_DEPTH; ++i) {
+	/* Move up the tree to the node where the plan will begin to be made.
+	 * The goal may be shallower if it topped out. */
+	while (goal->g > PLAN_DEPTH)
 		goal = goal->parent;
-	}
 	for (fp = goal; fp->parent; fp = fp->parent) {
 		n_move += fp->n_action;
 	}
@@ -206,37 +548,449 @@ mkplan(void *region, FieldNode *goal)
 	return planstr;
 }
 
+/* Index of a state of the input path search, _gravity_ numbering its
+ * gravity timer */
+static size_t
+path_key(HidamariPlayField const *field, size_t gravity)
+{
+	Hidamari const *t = &field->current;
+
+	return (((gravity * PATH_SLIDES + field->slide_timer) * 4
+			+ t->orientation) * HIDAMARI_HEIGHT + t->pos.y)
+		* (HIDAMARI_WIDTH + 2) + t->pos.x + 2;
+}
+
 size_t
 ai_size_requirement()
 {
-	return pow(36, DEPTH) * (sizeof(FieldNode) + 10);
+	size_t i;
+	size_t n_node = 0;
+
+	/* Every node of the search tree, along with its inputs */
+	for (i = 0; i <= DEPTH; ++i) {
+		n_node += pow(BRANCH, i);
+	}
+	return n_node * (REGION_SIZE(sizeof(FieldNode)) + REGION_SIZE(2 + SHIFTS))
+		+ REGION_SIZE(PATH_NODES * sizeof(PathNode))
+		+ REGION_SIZE(PATH_STATES / 64 * sizeof(u64))
+		+ 2 * REGION_SIZE(HIDAMARI_PLAN_MAX);
 }
 
 Button const *
-ai_plan(void *region, double weight[3], HidamariPlayField const *init) {
+ai_path(void *region, HidamariPlayField const *init, Hidamari const *target)
+{
+	/* Hard drop comes first so it is preferred among equally short plans.
+	 * Waiting is left out, since BUTTON_NONE ends a plan. */
+	static Button const moves[] = {
+		BUTTON_B,
+		BUTTON_LEFT,
+		BUTTON_RIGHT,
+		BUTTON_R,
+		BUTTON_L,
+		BUTTON_DOWN,
+	};
+	/* The gravity timer after each number of frames, and the first
+	 * number of frames it had that value after */
+	f32 gravity[HIDAMARI_PLAN_MAX];
+	size_t gravity_id[HIDAMARI_PLAN_MAX];
+	size_t n_frame = 0;
+	u64 *seen;
+	PathNode *node;
+	HidamariPlayField tmp = *init;
+	Button *planstr;
+	size_t head, tail, used;
+	size_t i, j, k, n;
+
+	/* The states are only needed until the inputs are found */
+	used = region_used(region);
+	planstr = region_alloc(region, HIDAMARI_PLAN_MAX);
+	node = region_alloc(region, PATH_NODES * sizeof(*node));
+	seen = region_alloc(region, PATH_STATES / 64 * sizeof(*seen));
+	if (!planstr || !node || !seen) {
+		region_rewind(region, used);
+		return NULL;
+	}
+	memset(seen, 0, PATH_STATES / 64 * sizeof(*seen));
+	node[0].current = init->current;
+	node[0].gravity_timer = init->gravity_timer;
+	node[0].slide_timer = init->slide_timer;
+	node[0].frame = 0;
+	node[0].parent = 0;
+	node[0].act = BUTTON_NONE;
+	gravity[n_frame] = init->gravity_timer;
+	gravity_id[n_frame++] = 0;
+	k = path_key(init, 0);
+	seen[k / 64] |= 1ULL << k % 64;
+	/* Every frame costs the same, so the first time the target locks
+	 * the path to it is the shortest among the states visited */
+	for (head = 0, tail = 1; head < tail; ++head) {
+		/* Longer paths are not taken */
+		if (node[head].frame + 1 >= HIDAMARI_PLAN_MAX)
+			break;
+		for (i = 0; i < LEN(moves); ++i) {
+			tmp.current = node[head].current;
+			tmp.gravity_timer = node[head].gravity_timer;
+			tmp.slide_timer = node[head].slide_timer;
+			if (field_move(&tmp, moves[i])) {
+				if (field_same_cells(&tmp.current, target))
+					goto found;
+				continue;
+			}
+			/* Every state one frame further has the same gravity */
+			if (n_frame == node[head].frame + 1u) {
+				gravity[n_frame] = tmp.gravity_timer;
+				for (j = 0; gravity[j] != gravity[n_frame]; ++j)
+					;
+				gravity_id[n_frame++] = j;
+			}
+			k = path_key(&tmp, gravity_id[node[head].frame + 1]);
+			if (seen[k / 64] & 1ULL << k % 64)
+				continue;
+			seen[k / 64] |= 1ULL << k % 64;
+			if (tail == PATH_NODES)
+				goto not_found;
+			node[tail].current = tmp.current;
+			node[tail].gravity_timer = tmp.gravity_timer;
+			node[tail].slide_timer = tmp.slide_timer;
+			node[tail].frame = node[head].frame + 1;
+			node[tail].parent = head;
+			node[tail].act = moves[i];
+			++tail;
+		}
+	}
+not_found:
+	region_rewind(region, used);
+	return NULL;
+found:
+	n = node[head].frame + 1;
+	planstr[n] = BUTTON_NONE;
+	planstr[--n] = moves[i];
+	for (k = head; 0 != k; k = node[k].parent)
+		planstr[--n] = node[k].act;
+	region_rewind(region, used + REGION_SIZE(HIDAMARI_PLAN_MAX));
+	return planstr;
+}
+
+/* Whether a leaf scored _score_ is better than _other_, the one an
+ * exhaustive search would meet first winning a tie */
+static bool
+ahead(double score, FieldNode const *fp, double other_score,
+		FieldNode const *other)
+{
+	return score < other_score
+		|| (score == other_score && fp->rank < other->rank);
+}
+
+/* Insert a leaf into the _n_ best leaves so far, kept in order of score
+ * among the first _max_ entries.
+ *
+ * Return: The new number of best leaves.
+ */
+static size_t
+keep_best(FieldNode *best[], double best_score[], size_t n, size_t max,
+		FieldNode *fp, double score)
+{
+	size_t i;
+
+	if (n == max && !ahead(score, fp, best_score[n - 1], best[n - 1]))
+		return n;
+	i = n < max ? n++ : n - 1;
+	for (; i > 0 && ahead(score, fp, best_score[i - 1], best[i - 1]); --i) {
+		best[i] = best[i - 1];
+		best_score[i] = best_score[i - 1];
+	}
+	best[i] = fp;
+	best_score[i] = score;
+	return n;
+}
+
+/* Score the leaves among _child_ with the model, all in one batch */
+static void
+score_leaves(FieldNode *child[], size_t n, FieldNode const *parent,
+		HidamariAIConfig const *config)
+{
+	size_t i, m = 0;
+	double f[BRANCH][HIDAMARI_FEATURE_LAST];
+	double score[BRANCH];
+	HidamariPlayField const *field[BRANCH];
+	FieldNode *live[BRANCH];
+
+	for (i = 0; i < n; ++i) {
+		if (child[i]->dead)
+			continue;
+		ai_features(&child[i]->field, &parent->field, &child[i]->placed,
+				HIDAMARI_FEATURE_LAST, f[m]);
+		field[m] = &child[i]->field;
+		live[m++] = child[i];
+	}
+	mlp_evaluate(config->mlp, field, (double const (*)[HIDAMARI_FEATURE_LAST])f,
+			m, score);
+	for (i = 0; i < m; ++i) {
+		live[i]->score = score[i];
+	}
+}
+
+/* A key of the cells a hidamari covers, the same for every orientation and
+ * position covering them */
+static u64
+cells_key(Hidamari const *t)
+{
+	int i;
+	u64 h, key = 0;
+	Vec2 cell[4];
+
+	field_cells(t, cell);
+	for (i = 0; i < 4; ++i) {
+		h = (u64)(cell[i].y * HIDAMARI_WIDTH + cell[i].x + 1)
+			* 0x9e3779b97f4a7c15ULL;
+		key += h ^ h >> 29;
+	}
+	return key;
+}
+
+/* Rank the children _parent_ was just expanded into, on top of the stack,
+ * in the order they would be visited without ordering. Children covering
+ * the same cells as one visited before them lead to the same board, and
+ * are dropped. Above the leaves they must also carry the same gravity timer
+ * over to the next hidamari, whose inputs depend on it. Those that will be expanded in turn are sorted best first
+ * by their static evaluation, dead ones last, and bounded if their
+ * children are leaves.
+ *
+ * Return: The number of children dropped.
+ */
+static size_t
+order(FieldNode **stackp, FieldNode const *parent,
+		HidamariAIConfig const *config)
+{
+	size_t i, j, n = 0, n_merged = 0;
+	u64 k, key[BRANCH];
+	double f[HIDAMARI_FEATURE_LAST];
+	double score[BRANCH], s;
+	FieldNode *child[BRANCH], *fp, *rest;
+
+	for (fp = *stackp; fp && fp->parent == parent; fp = fp->next) {
+		k = cells_key(&fp->placed);
+		for (i = 0; i < n; ++i) {
+			if (key[i] == k && (DEPTH == fp->g
+			    || child[i]->field.gravity_timer == fp->field.gravity_timer)
+			    && field_same_cells(&child[i]->placed, &fp->placed))
+				break;
+		}
+		if (i < n) {
+			n_merged += 1;
+			continue;
+		}
+		fp->rank = parent->rank * BRANCH + n;
+		key[n] = k;
+		child[n++] = fp;
+	}
+	rest = fp;
+	if (0 == n)
+		return n_merged;
+	if (DEPTH == child[0]->g) {
+		if (config->mlp)
+			score_leaves(child, n, parent, config);
+	} else {
+		for (i = 0; i < n; ++i) {
+			fp = child[i];
+			s = INFINITY;
+			if (!fp->dead) {
+				ai_features(&fp->field, &parent->field, &fp->placed,
+						config->n_weight, f);
+				s = weigh(f, config);
+				/* The bound only holds for the weights */
+				if (DEPTH - 1 == fp->g && !config->mlp)
+					fp->bound = leaf_bound(&fp->field, f, config);
+			}
+			/* Insertion sort, stable so ties keep their order */
+			for (j = i; j > 0 && s < score[j - 1]; --j) {
+				score[j] = score[j - 1];
+				child[j] = child[j - 1];
+			}
+			score[j] = s;
+			child[j] = fp;
+		}
+	}
+	for (i = n; i-- > 0;) {
+		child[i]->next = i + 1 < n ? child[i + 1] : rest;
+	}
+	*stackp = child[0];
+	return n_merged;
+}
+
+/* Pick the goal among the best leaves by Monte Carlo playouts from each.
+ * Ties go to the leaf with the better static evaluation.
+ *
+ * Return: The index of the goal in _best_.
+ */
+static size_t
+rollout_goal(HidamariAIConfig const *config, HidamariPlayField const *init,
+		FieldNode *best[], size_t n_best)
+{
+	size_t i, goal = 0;
+	long long score[ROLLOUT_CANDIDATES];
+	HidamariPlayField const *cand[ROLLOUT_CANDIDATES];
+
+	for (i = 0; i < n_best; ++i) {
+		cand[i] = &best[i]->field;
+	}
+	/* Seeded from the position, so a decision is reproducible */
+	rollout_score(config, init->rng ^ init->pieces, cand, n_best, score);
+	for (i = 1; i < n_best; ++i) {
+		if (score[i] > score[goal])
+			goal = i;
+	}
+	return goal;
+}
+
+/* Search the placements from _init_ for the leaf to aim for.
+ *
+ * Return: The goal leaf, with its static evaluation in _score_.
+ */
+static FieldNode *
+search(void *region, HidamariAIConfig const *config,
+		HidamariPlayField const *init, double *score)
+{
 	FieldNode *stack;
-	FieldNode *goal;
 	FieldNode *fp;
+	FieldNode *best[ROLLOUT_CANDIDATES] = {NULL};
+	double best_score[ROLLOUT_CANDIDATES];
+	size_t goal = 0, n_best = 0;
+	size_t max_best = config->n_playout > 0 ? ROLLOUT_CANDIDATES : 1;
+	u64 n_node = 0, n_leaf = 0, n_pruned = 0, n_merged = 0;
 
 	stack = create_node(region, init);
-	goal = NULL;
 	while (stack) {
 		fp = stack;
 		stack = stack->next;
-		if (DEPTH == fp->g) {
-			/* Evaluate the current goal state for "goodness" */
-			if (!goal) {
-				goal = fp;
-			} else if (evaluate(&fp->field, weight)
-			         < evaluate(&goal->field, weight)) {
-				goal = fp;
-			}
+		if (DEPTH == fp->g || fp->dead) {
+			n_leaf += 1;
+			/* Evaluate the current goal state for "goodness". Topping
+			 * out is only ever chosen as a last resort. */
+			n_best = keep_best(best, best_score, n_best, max_best,
+					fp, fp->dead ? INFINITY
+					: config->mlp ? fp->score
+					: evaluate(fp, config));
+		} else if (n_best == max_best
+		           && fp->bound > best_score[n_best - 1]) {
+			n_pruned += 1;
 		} else {
-			if (0 > expand(region, &stack, fp)) {
+			n_node += 1;
+			if (0 > ai_expand(region, &stack, fp)) {
 				fprintf(stderr, "error: Ran out of memory during AI planning %zu\n", *(size_t *)region);
 				exit(1);
 			}
+			n_merged += order(&stack, fp, config);
 		}
 	}
-	return mkplan(region, goal);
+	if (n_best > 1)
+		goal = rollout_goal(config, init, best, n_best);
+	telemetry_count(TELEMETRY_NODES, n_node);
+	telemetry_count(TELEMETRY_LEAVES, n_leaf);
+	telemetry_count(TELEMETRY_PRUNED, n_pruned);
+	telemetry_count(TELEMETRY_MERGED, n_merged);
+	*score = best_score[goal];
+	return best[goal];
+}
+
+/* Account for a plan that started at _start_ */
+static void
+count_plan(void *region, u64 start)
+{
+	start = telemetry_now() - start;
+	telemetry_count(TELEMETRY_PLANS, 1);
+	telemetry_count(TELEMETRY_PLAN_NS, start);
+	telemetry_sample(TELEMETRY_HIST_PLAN_NS, start);
+	telemetry_peak(TELEMETRY_REGION_BYTES, region_used(region));
+}
+
+Button const *
+ai_plan(void *region, HidamariAIConfig const *config,
+		HidamariPlayField const *init)
+{
+	FieldNode *goal;
+	FieldNode *fp;
+	Button const *planstr;
+	double score;
+	u64 start = telemetry_now();
+	Hidamari target;
+
+	/* Play straight from the book if it knows the position */
+	if (config->book && book_probe(config->book, init, &target)) {
+		planstr = ai_path(region, init, &target);
+		if (planstr) {
+			telemetry_count(TELEMETRY_BOOK_HITS, 1);
+			count_plan(region, start);
+			return planstr;
+		}
+	}
+	/* Or towards a perfect clear if there is one */
+	if (config->pc_pieces > 0) {
+		planstr = pc_plan(region, init, config->pc_pieces);
+		if (planstr) {
+			telemetry_count(TELEMETRY_PC_PLANS, 1);
+			count_plan(region, start);
+			return planstr;
+		}
+	}
+	/* Or as searched before */
+	if (evalcache_probe(config, init, &target, &score)) {
+		planstr = ai_path(region, init, &target);
+		if (planstr) {
+			telemetry_count(TELEMETRY_CACHE_HITS, 1);
+			count_plan(region, start);
+			return planstr;
+		}
+	}
+	goal = search(region, config, init, &score);
+	for (fp = goal; 1 < fp->g; fp = fp->parent)
+		;
+	evalcache_store(config, init, &fp->placed, score);
+	/* Replace the naive inputs of the first placement with the quickest
+	 * ones that reach it */
+	planstr = NULL;
+	if (1 == PLAN_DEPTH)
+		planstr = ai_path(region, init, &fp->placed);
+	if (!planstr)
+		planstr = mkplan(region, goal);
+	count_plan(region, start);
+	return planstr;
+}
+
+void
+ai_choose(void *region, HidamariAIConfig const *config,
+		HidamariPlayField const *init, AIChoice *choice)
+{
+	FieldNode *fp;
+	PCSolution pc;
+	u64 start = telemetry_now();
+
+	/* Like ai_plan(), only take placements that can be reached */
+	if (config->book && book_probe(config->book, init, &choice->placed)
+	    && ai_path(region, init, &choice->placed)) {
+		choice->score = NAN;
+		telemetry_count(TELEMETRY_BOOK_HITS, 1);
+		count_plan(region, start);
+		return;
+	}
+	if (config->pc_pieces > 0 && 1 == pc_solve(init, config->pc_pieces, &pc)
+	    && ai_path(region, init, &pc.placed[0])) {
+		choice->placed = pc.placed[0];
+		choice->score = NAN;
+		telemetry_count(TELEMETRY_PC_PLANS, 1);
+		count_plan(region, start);
+		return;
+	}
+	if (evalcache_probe(config, init, &choice->placed, &choice->score)
+	    && ai_path(region, init, &choice->placed)) {
+		telemetry_count(TELEMETRY_CACHE_HITS, 1);
+		count_plan(region, start);
+		return;
+	}
+	fp = search(region, config, init, &choice->score);
+	while (fp->g > 1)
+		fp = fp->parent;
+	choice->placed = fp->placed;
+	evalcache_store(config, init, &choice->placed, choice->score);
+	count_plan(region, start);
 }
@@ -15,11 +15,34 @@ struct FieldNode {
 	size_t g;
 	size_t n_action;
 	Button *action;
+	Hidamari placed; /* The hidamari as it was locked to reach this state */
+	bool dead; /* Locking it topped out */
+	u64 rank; /* Place in the order an unpruned search would visit it */
+	double bound; /* Lower bound on the score of any leaf below it */
+	double score; /* Score of a leaf, when evaluated with its siblings */
 	HidamariPlayField field;
 	FieldNode *parent;
 	FieldNode *next;
 };
 
+/* A placement chosen by the search */
+typedef struct {
+	Hidamari placed; /* The current hidamari as it locks */
+	double score; /* Evaluation of the leaf aimed for, NAN if not searched */
+} AIChoice;
+
+/* Expands a fieldnode by branching out on all possible permutations of the
+ * current hidamari, as the search does: up to two clockwise rotations, then
+ * shifts to either side, then a hard drop. The children are pushed onto
+ * _stackp_, and may repeat placements. While the stack is too low for the
+ * inputs to reach, the children are dropped straight onto its surface,
+ * with the outcome of each input sequence cached per thread.
+ *
+ * Returns 0 if successful, or -1 if it runs out of memory.
+ */
+int
+ai_expand(void *region, FieldNode **stackp, FieldNode *parent);
+
 /* Compute the minimum size of the region needed by ai_plan() */
 size_t
 ai_size_requirement();
@@ -29,15 +52,80 @@ ai_size_requirement();
  * against the current best state. One the search completes, a plan is made for
  * the state that evaluated to the lowest score.
  *
+ * Children are searched best first by their static evaluation, and a
+ * subtree is skipped when a lower bound on its leaves cannot beat the best
+ * found so far, as are positions that have topped out. Siblings locking
+ * their hidamari into the same cells reach the same board, which is only
+ * searched once, if they also leave the same gravity timer or are leaves. Ties go to the leaf an exhaustive search would have met
+ * first, so the plan is the same. Positions found in the evaluation cache,
+ * if there is one, are not searched again; see evalcache.h.
+ *
  * Parameters:
  *	- region: A pre-allocated memory region for the search to use. If not
  *	a sufficient size, the search will fail.
+ *	- config: Weights of the board features used to evaluate states.
  *	- init: The initial state for the AI to search from.
  *
  * Return: An array of button inputs devised by the AI in order to achieve
  *	at a desirable state.
  */
 Button const *
-ai_plan(void *region, double weight[3], HidamariPlayField const *init);
+ai_plan(void *region, HidamariAIConfig const *config,
+		HidamariPlayField const *init);
+
+/* Choose where to lock the current hidamari as ai_plan() would, without
+ * working out the inputs to get it there. The placement can be played with
+ * field_place().
+ */
+void
+ai_choose(void *region, HidamariAIConfig const *config,
+		HidamariPlayField const *init, AIChoice *choice);
+
+/* Extract the board features of _field_ in a single pass over its grid.
+ * The eroded cells and landing height describe the placement of _placed_
+ * onto _prev_ that led to _field_, and are only computed when _n_ covers
+ * them and both are given.
+ */
+void
+ai_features(HidamariPlayField const *field, HidamariPlayField const *prev,
+		Hidamari const *placed, size_t n, double f[HIDAMARI_FEATURE_LAST]);
+
+/* Load a weight vector of up to HIDAMARI_FEATURE_LAST whitespace separated
+ * numbers from a file, in feature order. The weights may be followed by
+ * "playouts <n_playout> <playout_depth> [n_thread]" to enable the Monte
+ * Carlo evaluation of the best leaves, then by "book <path>" to play
+ * the openings of a book file, then by "mlp <path>" to score leaves
+ * with a model file, and then by "clear <n_piece>" to play towards a
+ * perfect clear within that many hidamaries whenever there is one. The
+ * weights still order the search and guide the playouts.
+ *
+ * Return: 0 if at least one weight was read and the book and model, if
+ *	any, could be opened, otherwise -1.
+ */
+int
+ai_config_load(HidamariAIConfig *config, char const *path);
+
+/* Perform a breadth-first search over the states the current hidamari can
+ * reach, one button per frame, to find the shortest sequence of inputs
+ * that locks it with the same cells as _target_. Soft drops, both rotation
+ * directions and sliding under overhangs are all considered, with gravity
+ * applied each frame exactly as in the game. Frames without a button are
+ * not, as BUTTON_NONE ends the inputs.
+ *
+ * A state is the position and orientation of the hidamari along with its
+ * gravity and lock timers, so one reached again later with other timers
+ * is searched from as well.
+ *
+ * Parameters:
+ *	- region: A pre-allocated memory region for the search to use.
+ *	- init: The state the inputs will be applied to.
+ *	- target: The placement to reach.
+ *
+ * Return: A BUTTON_NONE terminated array of button inputs, or NULL if the
+ *	target cannot be reached within HIDAMARI_PLAN_MAX inputs or the region
+ *	is too small.
+ */
+Button const *
+ai_path(void *region, HidamariPlayField const *init, Hidamari const *target);
 
 #endif
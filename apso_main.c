@@ -1,58 +1,240 @@
 /* See LICENSE file for copyright and license details */
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <apso.h>
 
 #include "hidamari.h"
 
+/* Every particle plays the same N_SEED games, so differences in fitness come
+ * from the weights and not from the luck of the piece sequence. */
+#define N_SEED 3
+#define MAX_LINES 60000
+
+/* The games of a particle are compared against the best particle so far
+ * after RACE_FIRST pieces, and again each time the number of pieces played
+ * doubles. A particle that has cleared less than RACE_MARGIN of the lines
+ * the best one had at the same point is cut off, and its fitness estimated
+ * from how the best one went on.
+ *
+ * This races each particle against the best so far rather than halving the
+ * particles of an iteration rung by rung, since apso() scores particles one
+ * at a time from its own threads and never hands over an iteration whole.
+ * A particle is raced at most once: if the swarm comes back to one that was
+ * cut off, its games are played in full. */
+#define RACE_FIRST 256
+#define RACE_ROUNDS 10
+#define RACE_MARGIN 0.75
+
+/* Number of fitness values remembered, must be a power of two */
+#define CACHE_SIZE 4096
+
+typedef struct {
+	bool used;
+	bool estimated; /* Cut off by the race rather than played in full */
+	float position[HIDAMARI_FEATURE_LAST];
+	float fitness;
+} CacheEntry;
+
 char *argv0;
 
+static u32 seed[N_SEED];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lines cleared by the best particle so far at the end of each round */
+static struct {
+	bool set;
+	float fitness;
+	double lines[RACE_ROUNDS];
+} incumbent;
+
+static CacheEntry cache[CACHE_SIZE];
+
 void
 usage()
 {
-	fprintf(stderr, "usage: %s <number of particles> <number of iterations>\n", argv0);
+	fprintf(stderr, "usage: %s <number of particles> <number of iterations> [seed]\n", argv0);
 	exit(EXIT_FAILURE);
 }
 
+static size_t
+cache_index(float const *position)
+{
+	size_t i;
+	uint64_t hash = 14695981039346656037ULL;
+	uint8_t const *p = (uint8_t const *)position;
+
+	for (i = 0; i < sizeof(*position) * HIDAMARI_FEATURE_LAST; ++i) {
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	}
+	return hash & (CACHE_SIZE - 1);
+}
+
+/* Look up the fitness of a position evaluated before, and whether it was
+ * estimated. The lock must be held. */
+static bool
+cache_get(float const *position, float *fitness, bool *estimated)
+{
+	size_t i, n;
+
+	i = cache_index(position);
+	for (n = 0; n < CACHE_SIZE && cache[i].used; ++n) {
+		if (0 == memcmp(cache[i].position, position, sizeof(cache[i].position))) {
+			*fitness = cache[i].fitness;
+			*estimated = cache[i].estimated;
+			return true;
+		}
+		i = (i + 1) & (CACHE_SIZE - 1);
+	}
+	return false;
+}
+
+/* Remember the fitness of a position, replacing any it had. Once the cache
+ * is full, the home slot of the position is overwritten. The lock must be
+ * held. */
+static void
+cache_put(float const *position, float fitness, bool estimated)
+{
+	size_t i, n;
+
+	i = cache_index(position);
+	for (n = 0; n < CACHE_SIZE && cache[i].used; ++n) {
+		if (0 == memcmp(cache[i].position, position, sizeof(cache[i].position)))
+			break;
+		i = (i + 1) & (CACHE_SIZE - 1);
+	}
+	if (CACHE_SIZE == n)
+		i = cache_index(position);
+	cache[i].used = true;
+	cache[i].estimated = estimated;
+	memcpy(cache[i].position, position, sizeof(cache[i].position));
+	cache[i].fitness = fitness;
+}
+
+/* Play a game until _until_ pieces have been placed, or it ends */
+static void
+play(HidamariGame *game, HidamariAIConfig const *config, size_t *pieces,
+		size_t until)
+{
+	while (HIDAMARI_GS_GAME_PLAYING == game->state
+	    && game->field.lines < MAX_LINES) {
+		if (hidamari_needs_plan(game)) {
+			if (*pieces >= until)
+				return;
+			*pieces += 1;
+		}
+		hidamari_pso_update(game, config);
+	}
+}
+
 float
 hidamari_fitness(void *arg, float const *position)
 {
 	(void)arg;
 
-	HidamariGame game;
-	double weight[3];
-
-	weight[0] = position[0];
-	weight[1] = position[1];
-	weight[2] = position[2];
-	hidamari_init(&game);
-	do {
-		hidamari_pso_update(&game, weight);
-	} while (game.state == GS_GAME_PLAYING && game.field.lines < 60000);
-	return game.field.lines;
+	size_t i, r;
+	size_t pieces[N_SEED] = {0};
+	double lines[RACE_ROUNDS];
+	double total;
+	bool alive, estimated, race = true;
+	float fitness;
+	HidamariGame game[N_SEED];
+	HidamariAIConfig config = {0};
+
+	pthread_mutex_lock(&lock);
+	if (cache_get(position, &fitness, &estimated)) {
+		if (!estimated) {
+			pthread_mutex_unlock(&lock);
+			return fitness;
+		}
+		/* Cut off before, so measure it this time */
+		race = false;
+	}
+	pthread_mutex_unlock(&lock);
+
+	config.n_weight = HIDAMARI_FEATURE_LAST;
+	for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+		config.weight[i] = position[i];
+	}
+	for (i = 0; i < N_SEED; ++i) {
+		hidamari_init(&game[i], NULL);
+		hidamari_start(&game[i], seed[i]);
+	}
+	for (r = 0; r < RACE_ROUNDS; ++r) {
+		total = 0;
+		alive = false;
+		for (i = 0; i < N_SEED; ++i) {
+			play(&game[i], &config, &pieces[i], (size_t)RACE_FIRST << r);
+			total += game[i].field.lines;
+			alive = alive || (HIDAMARI_GS_GAME_PLAYING == game[i].state
+			               && game[i].field.lines < MAX_LINES);
+		}
+		lines[r] = total;
+		if (!alive)
+			break;
+		if (!race)
+			continue;
+		pthread_mutex_lock(&lock);
+		if (incumbent.set && total < RACE_MARGIN * incumbent.lines[r]) {
+			/* Extrapolate from how the best particle went on */
+			fitness = incumbent.fitness * total / incumbent.lines[r];
+			cache_put(position, fitness, true);
+			pthread_mutex_unlock(&lock);
+			return fitness;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* The particle survived every round, play its games to the end */
+	total = 0;
+	for (i = 0; i < N_SEED; ++i) {
+		play(&game[i], &config, &pieces[i], SIZE_MAX);
+		total += game[i].field.lines;
+	}
+	for (; r < RACE_ROUNDS; ++r) {
+		lines[r] = total;
+	}
+	fitness = total / N_SEED;
+
+	pthread_mutex_lock(&lock);
+	if (!incumbent.set || fitness > incumbent.fitness) {
+		incumbent.set = true;
+		incumbent.fitness = fitness;
+		memcpy(incumbent.lines, lines, sizeof(lines));
+	}
+	cache_put(position, fitness, false);
+	pthread_mutex_unlock(&lock);
+	return fitness;
 }
 
 int
 main(int argc, char **argv)
 {
+	size_t i;
 	size_t n_particle;
 	size_t n_iteration;
 	float *best;
 
-	srand(time(NULL));
 	argv0 = argv[0];
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 		usage();
 	n_particle = strtol(argv[1], NULL, 10);
 	n_iteration = strtol(argv[2], NULL, 10);
-	best = apso(4, n_iteration, n_particle, 3, -1, 1, 0.8, 0.1, 0.2,
-			NULL, hidamari_fitness);
-	printf("best position: (%f, %f, %f)\n",
-			best[0],
-			best[1],
-			best[2]);
+	srand(4 == argc ? strtoul(argv[3], NULL, 10) : (unsigned long)time(NULL));
+	for (i = 0; i < N_SEED; ++i) {
+		seed[i] = rand();
+	}
+	best = apso(4, n_iteration, n_particle, HIDAMARI_FEATURE_LAST, -1, 1,
+			0.8, 0.1, 0.2, NULL, hidamari_fitness);
+	/* Printed in the format read by ai_config_load() */
+	for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+		printf("%f%c", best[i], i + 1 < HIDAMARI_FEATURE_LAST ? ' ' : '\n');
+	}
 	free(best);
 	return 0;
 }
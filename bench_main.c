@@ -0,0 +1,226 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "evalcache.h"
+#include "hidamari.h"
+#include "host.h"
+#include "spectate.h"
+#include "stats.h"
+#include "telemetry.h"
+
+/* A headless, seeded AI workload. The same arguments always play the same
+ * games, which makes it suitable both as a benchmark and as the training
+ * run for profile-guided builds. The games are played one after another,
+ * or all at once on the worker pool of host.h, with the same results. */
+
+/* Timesteps the host advances its games by between checks */
+#define HOST_TICKS 1024
+
+char *argv0;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-j threads] [-s stats file] [-x export name] "
+			"[-e cache entries] [games] [lines] [seed] [weights file]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Report a finished game and add it to the totals */
+static void
+finish(size_t i, HidamariGame const *game, StatsSink *sink, u64 *ticks,
+		u64 *pieces, u64 *lines)
+{
+	StatsRecord record;
+
+	printf("game %zu: %u lines, %u pieces, score %u\n", i,
+			game->field.lines, game->field.pieces, game->field.score);
+	*ticks += game->stats.ticks;
+	*pieces += game->field.pieces;
+	*lines += game->field.lines;
+	if (sink) {
+		stats_record(game, &record);
+		stats_push(sink, &record);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	size_t i, len;
+	size_t n_game = 4, n_worker = 0;
+	bool pool = false;
+	u32 max_lines = 200;
+	u32 seed = 1;
+	u64 ticks = 0, pieces = 0, lines = 0;
+	double start, elapsed;
+	HidamariGame game;
+	HidamariAIConfig config;
+	HidamariTelemetry t;
+	HidamariHost *host = NULL;
+	StatsSink *sink = NULL;
+	Spectate *spec = NULL;
+
+	argv0 = argv[0];
+	while (-1 != (opt = getopt(argc, argv, "j:s:x:e:"))) {
+		switch (opt) {
+		case 'j':
+			/* 0 for one thread per CPU */
+			n_worker = strtoul(optarg, NULL, 10);
+			pool = true;
+			break;
+		case 's':
+			/* Written as CSV if the name says so */
+			len = strlen(optarg);
+			sink = stats_open(optarg, len > 4
+					&& 0 == strcmp(optarg + len - 4, ".csv")
+					? STATS_CSV : STATS_BINARY, 4096);
+			if (!sink) {
+				fprintf(stderr, "error: Could not open %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			/* Games are played one after another in the same slot */
+			spec = spectate_create(optarg, 1, SPECTATE_FIELD);
+			if (!spec) {
+				fprintf(stderr, "error: Could not export to %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+			/* Games share the search results of the positions they
+			 * have in common */
+			if (0 > evalcache_init(strtoull(optarg, NULL, 10))) {
+				fprintf(stderr, "error: Could not allocate the cache\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc > 5)
+		usage();
+	if (argc > 1)
+		n_game = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		max_lines = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		seed = strtoul(argv[3], NULL, 10);
+	if (argc > 4 && 0 > ai_config_load(&config, argv[4])) {
+		fprintf(stderr, "error: Could not read AI weights from %s\n", argv[4]);
+		return EXIT_FAILURE;
+	}
+
+	if (pool) {
+		host = host_create(n_worker, n_game, max_lines);
+		if (!host) {
+			fprintf(stderr, "error: Could not start the workers\n");
+			return EXIT_FAILURE;
+		}
+	}
+	start = now();
+	if (host) {
+		for (i = 0; i < n_game; ++i) {
+			if (argc > 4)
+				host_game(host, i)->ai.config = &config;
+			hidamari_start(host_game(host, i), seed + i);
+		}
+		/* Only the first game is exported */
+		while (host_step(host, HOST_TICKS) > 0) {
+			if (spec && n_game > 0)
+				spectate_publish(spec, 0, host_game(host, 0));
+		}
+		for (i = 0; i < n_game; ++i) {
+			finish(i, host_game(host, i), sink, &ticks, &pieces, &lines);
+		}
+		host_destroy(host);
+	} else {
+		hidamari_init(&game, NULL);
+		game.ai.active = true;
+		if (argc > 4)
+			game.ai.config = &config;
+		for (i = 0; i < n_game; ++i) {
+			hidamari_start(&game, seed + i);
+			while (HIDAMARI_GS_GAME_PLAYING == game.state
+			    && game.field.lines < max_lines) {
+				hidamari_update(&game, BUTTON_NONE);
+				if (spec)
+					spectate_publish(spec, 0, &game);
+			}
+			finish(i, &game, sink, &ticks, &pieces, &lines);
+		}
+	}
+	elapsed = now() - start;
+	if (sink && 0 > stats_close(sink))
+		fprintf(stderr, "error: Could not write all game statistics\n");
+	if (spec)
+		spectate_destroy(spec);
+
+	printf("%llu lines, %llu pieces, %llu timesteps in %.3fs\n",
+			(unsigned long long)lines, (unsigned long long)pieces,
+			(unsigned long long)ticks, elapsed);
+	printf("%.1f pieces/s, %.1f timesteps/s\n",
+			pieces / elapsed, ticks / elapsed);
+	telemetry_read(&t);
+	if (t.counter[TELEMETRY_PLAN_NS] > 0) {
+		printf("%.1f nodes/s, %.1f leaves/s, median plan %lluus\n",
+				t.counter[TELEMETRY_NODES] * 1e9 / t.counter[TELEMETRY_PLAN_NS],
+				t.counter[TELEMETRY_LEAVES] * 1e9 / t.counter[TELEMETRY_PLAN_NS],
+				(unsigned long long)telemetry_quantile(
+					&t.hist[TELEMETRY_HIST_PLAN_NS], 0.5) / 1000);
+	}
+	if (t.counter[TELEMETRY_PRUNED] > 0) {
+		printf("%llu of %llu subtrees pruned\n",
+				(unsigned long long)t.counter[TELEMETRY_PRUNED],
+				(unsigned long long)(t.counter[TELEMETRY_NODES]
+					+ t.counter[TELEMETRY_PRUNED]));
+	}
+	if (t.counter[TELEMETRY_MERGED] > 0) {
+		printf("%llu of %llu placements merged with a sibling\n",
+				(unsigned long long)t.counter[TELEMETRY_MERGED],
+				(unsigned long long)(t.counter[TELEMETRY_NODES]
+					+ t.counter[TELEMETRY_LEAVES]
+					+ t.counter[TELEMETRY_PRUNED]
+					+ t.counter[TELEMETRY_MERGED]));
+	}
+	if (t.counter[TELEMETRY_BOOK_HITS] > 0) {
+		printf("%llu of %llu plans from the book\n",
+				(unsigned long long)t.counter[TELEMETRY_BOOK_HITS],
+				(unsigned long long)t.counter[TELEMETRY_PLANS]);
+	}
+	if (t.counter[TELEMETRY_CACHE_HITS] > 0) {
+		printf("%llu of %llu plans from the cache\n",
+				(unsigned long long)t.counter[TELEMETRY_CACHE_HITS],
+				(unsigned long long)t.counter[TELEMETRY_PLANS]);
+	}
+	if (t.counter[TELEMETRY_PC_PLANS] > 0) {
+		printf("%llu of %llu plans towards a perfect clear\n",
+				(unsigned long long)t.counter[TELEMETRY_PC_PLANS],
+				(unsigned long long)t.counter[TELEMETRY_PLANS]);
+	}
+	if (t.counter[TELEMETRY_PLAYOUTS] > 0) {
+		printf("%.1f playouts/s\n", t.counter[TELEMETRY_PLAYOUTS] * 1e9
+				/ t.counter[TELEMETRY_PLAN_NS]);
+	}
+	return 0;
+}
@@ -0,0 +1,253 @@
+/* See LICENSE file for copyright and license details */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "book.h"
+#include "field.h"
+#include "hidamari.h"
+
+/* Each shape and its mirror image */
+static HidamariShape const mirror_shape[HIDAMARI_LAST] = {
+	[HIDAMARI_I] = HIDAMARI_I,
+	[HIDAMARI_J] = HIDAMARI_L,
+	[HIDAMARI_L] = HIDAMARI_J,
+	[HIDAMARI_O] = HIDAMARI_O,
+	[HIDAMARI_S] = HIDAMARI_Z,
+	[HIDAMARI_T] = HIDAMARI_T,
+	[HIDAMARI_Z] = HIDAMARI_S,
+};
+
+static HidamariRow
+mirror_row(HidamariRow row)
+{
+	int x;
+	HidamariRow ret = 0;
+
+	for (; row; row &= row - 1) {
+		x = row_ctz(row);
+		ret |= (HidamariRow)1 << (HIDAMARI_WIDTH - 1 - x);
+	}
+	return ret;
+}
+
+static u64
+mix(u64 h, u64 v)
+{
+	h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static u64
+hash(HidamariPlayField const *field, bool mirror)
+{
+	int y;
+	u64 h = 0;
+	HidamariRow row;
+
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		row = field->grid[y];
+		/* Empty rows are their own mirror image */
+		if (mirror && HIDAMARI_ROW_WALLS != row)
+			row = mirror_row(row);
+		h = mix(h, row);
+	}
+	h = mix(h, mirror ? mirror_shape[field->current.shape]
+			: field->current.shape);
+	return mix(h, mirror ? mirror_shape[field->next] : field->next);
+}
+
+u64
+book_key(HidamariPlayField const *field, bool *mirrored)
+{
+	u64 h = hash(field, false);
+	u64 m = hash(field, true);
+
+	*mirrored = m < h;
+	return *mirrored ? m : h;
+}
+
+HidamariBook *
+book_open(char const *path)
+{
+	int fd;
+	struct stat st;
+	BookHeader const *header;
+	HidamariBook *book;
+
+	fd = open(path, O_RDONLY);
+	if (0 > fd)
+		return NULL;
+	book = calloc(1, sizeof(*book));
+	if (!book || 0 > fstat(fd, &st) || (size_t)st.st_size < sizeof(*header))
+		goto fail;
+	book->size = st.st_size;
+	book->map = mmap(NULL, book->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == book->map)
+		goto fail;
+	close(fd);
+	header = book->map;
+	book->entry = (BookEntry const *)(header + 1);
+	book->n_entry = header->n_entry;
+	if (0 != memcmp(header->magic, BOOK_MAGIC, sizeof(header->magic))
+	    || HIDAMARI_WIDTH != header->width
+	    || HIDAMARI_HEIGHT != header->height
+	    || book->n_entry > (book->size - sizeof(*header)) / sizeof(BookEntry)) {
+		book_close(book);
+		return NULL;
+	}
+	return book;
+fail:
+	free(book);
+	close(fd);
+	return NULL;
+}
+
+void
+book_close(HidamariBook *book)
+{
+	munmap(book->map, book->size);
+	free(book);
+}
+
+void
+book_entry(HidamariPlayField const *field, Hidamari const *placed,
+		BookEntry *entry)
+{
+	int i;
+	bool mirrored;
+	Vec2 cell[4];
+
+	entry->key = book_key(field, &mirrored);
+	field_cells(placed, cell);
+	for (i = 0; i < 4; ++i) {
+		entry->cell[i][0] = mirrored ? HIDAMARI_WIDTH - 1 - cell[i].x
+			: cell[i].x;
+		entry->cell[i][1] = cell[i].y;
+	}
+}
+
+/* Check if a hidamari covers exactly the given cells */
+static bool
+covers(Hidamari const *t, Vec2 const want[4])
+{
+	int i, j;
+	Vec2 cell[4];
+
+	field_cells(t, cell);
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < 4; ++j) {
+			if (cell[i].x == want[j].x && cell[i].y == want[j].y)
+				break;
+		}
+		if (4 == j)
+			return false;
+	}
+	return true;
+}
+
+/* Find the orientation and position of the current hidamari that covers
+ * exactly the given cells */
+static bool
+resolve(HidamariPlayField const *field, Vec2 const want[4], Hidamari *target)
+{
+	int j, o;
+	Vec2 cell[4];
+
+	*target = field->current;
+	for (o = 0; o < 4; ++o) {
+		target->orientation = o;
+		target->pos.x = 0;
+		target->pos.y = 0;
+		field_cells(target, cell);
+		/* Try lining up its first cell with each of the wanted ones */
+		for (j = 0; j < 4; ++j) {
+			target->pos.x = want[j].x - cell[0].x;
+			target->pos.y = want[j].y - cell[0].y;
+			if (covers(target, want))
+				return true;
+		}
+	}
+	return false;
+}
+
+bool
+book_probe(HidamariBook const *book, HidamariPlayField const *field,
+		Hidamari *target)
+{
+	int i;
+	bool mirrored;
+	size_t lo = 0, hi = book->n_entry, mid;
+	u64 k = book_key(field, &mirrored);
+	BookEntry const *e;
+	Vec2 want[4];
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (book->entry[mid].key < k) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == book->n_entry || book->entry[lo].key != k)
+		return false;
+	e = &book->entry[lo];
+	for (i = 0; i < 4; ++i) {
+		want[i].x = mirrored ? HIDAMARI_WIDTH - 1 - e->cell[i][0]
+			: e->cell[i][0];
+		want[i].y = e->cell[i][1];
+		/* A hash collision could point anywhere */
+		if (want[i].x <= 0 || want[i].x >= HIDAMARI_WIDTH - 1
+		    || want[i].y <= 0 || want[i].y >= HIDAMARI_HEIGHT
+		    || field->grid[want[i].y] & (HidamariRow)1 << want[i].x)
+			return false;
+	}
+	return resolve(field, want, target);
+}
+
+/* Order by key, then by placement, so the entry kept of each key does not
+ * depend on the order qsort() leaves equal ones in */
+static int
+compare(void const *a, void const *b)
+{
+	BookEntry const *ea = a;
+	BookEntry const *eb = b;
+
+	if (ea->key != eb->key)
+		return (ea->key > eb->key) - (ea->key < eb->key);
+	return memcmp(ea->cell, eb->cell, sizeof(ea->cell));
+}
+
+int
+book_write(char const *path, BookEntry *entry, size_t n_entry)
+{
+	size_t i, n = 0;
+	FILE *fp;
+	BookHeader header = {
+		.width = HIDAMARI_WIDTH,
+		.height = HIDAMARI_HEIGHT,
+	};
+
+	qsort(entry, n_entry, sizeof(*entry), compare);
+	for (i = 0; i < n_entry; ++i) {
+		if (0 == n || entry[n - 1].key != entry[i].key)
+			entry[n++] = entry[i];
+	}
+	memcpy(header.magic, BOOK_MAGIC, sizeof(header.magic));
+	header.n_entry = n;
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+	if (1 != fwrite(&header, sizeof(header), 1, fp)
+	    || n != fwrite(entry, sizeof(*entry), n, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	return 0 == fclose(fp) ? 0 : -1;
+}
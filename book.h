@@ -0,0 +1,78 @@
+/* See LICENSE file for copyright and license details */
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* An opening book maps early positions to the placement the AI chose for
+ * them, so that they can be played without searching. A position is keyed
+ * by a hash of its grid and its current and next hidamari. A position and
+ * its left-right mirror image, with J and L and S and Z swapped, share one
+ * entry.
+ *
+ * A book file is a BookHeader followed by its entries sorted by key, in
+ * the byte order of the machine that wrote it. */
+
+#define BOOK_MAGIC "HDMBOOK1"
+
+typedef struct {
+	char magic[8];
+	u32 width; /* Board the book was made for */
+	u32 height;
+	u64 n_entry;
+} BookHeader;
+
+typedef struct {
+	u64 key;
+	u8 cell[4][2]; /* x and y of each cell of the placement */
+} BookEntry;
+
+struct HidamariBook {
+	void *map;
+	size_t size;
+	BookEntry const *entry;
+	size_t n_entry;
+};
+
+/* Map a book file into memory.
+ *
+ * Return: The book, or NULL if the file cannot be read or was made for
+ *	another board size.
+ */
+HidamariBook *
+book_open(char const *path);
+
+void
+book_close(HidamariBook *book);
+
+/* Key of a position, and whether it is its mirror image that the key and
+ * entry describe */
+u64
+book_key(HidamariPlayField const *field, bool *mirrored);
+
+/* Make the entry for playing _placed_, the current hidamari of _field_ as
+ * it would lock */
+void
+book_entry(HidamariPlayField const *field, Hidamari const *placed,
+		BookEntry *entry);
+
+/* Look up the placement of the current hidamari of _field_.
+ *
+ * Return: true and the placement in _target_ if the book has one.
+ */
+bool
+book_probe(HidamariBook const *book, HidamariPlayField const *field,
+		Hidamari *target);
+
+/* Sort _entry_, drop repeated keys, keeping the lowest placement of each,
+ * and write it out as a book file.
+ *
+ * Return: 0 on success, -1 if the file could not be written.
+ */
+int
+book_write(char const *path, BookEntry *entry, size_t n_entry);
+
+#endif
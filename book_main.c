@@ -0,0 +1,173 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai.h"
+#include "book.h"
+#include "field.h"
+#include "hidamari.h"
+#include "region.h"
+#include "vector.h"
+
+/* Build an opening book: starting from every first position a game can
+ * have, let the AI choose a placement, and follow up with every possible
+ * next hidamari, until the given number of hidamaries have been placed. */
+
+#define KEY_HASH(k) (k)
+#define KEY_EQUAL(a, b) ((a) == (b))
+
+/* Keys are hashes already */
+HASHMAP_INSTANTIATE(KeySet, u64, bool, KEY_HASH, KEY_EQUAL, vec_heap)
+VECTOR_INSTANTIATE(FieldVec, HidamariPlayField, vec_heap)
+VECTOR_INSTANTIATE(EntryVec, BookEntry, vec_heap)
+
+char *argv0;
+
+/* Positions whose placement has been chosen */
+static KeySet seen = HASHMAP_ZERO;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s <book file> [depth] [weights file]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static void
+out_of_memory()
+{
+	fprintf(stderr, "error: Out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Mark a key as seen.
+ *
+ * Return: true if it was seen before.
+ */
+static bool
+see(u64 key)
+{
+	bool added;
+
+	if (!KeySet_get(&seen, key, &added))
+		out_of_memory();
+	return !added;
+}
+
+/* Play the AI's plan for the current hidamari until it locks.
+ *
+ * Return: The state of the game after locking, with the hidamari as it
+ *	locked in _placed_.
+ */
+static int
+play(HidamariPlayField *field, Button const *plan, Hidamari *placed)
+{
+	size_t i = 0;
+	Button act;
+
+	for (;;) {
+		act = BUTTON_NONE != plan[i] ? plan[i++] : BUTTON_NONE;
+		if (field_move(field, act))
+			break;
+	}
+	*placed = field->current;
+	return field_lock(field);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i, d, depth = 4;
+	size_t n;
+	bool mirrored;
+	int state;
+	void *region;
+	HidamariShape s, t;
+	Hidamari placed;
+	HidamariPlayField field;
+	FieldVec level = VEC_ZERO, next = VEC_ZERO, tmp;
+	BookEntry e;
+	EntryVec entry = VEC_ZERO;
+	HidamariAIConfig config;
+	HidamariGame game;
+
+	argv0 = argv[0];
+	if (argc < 2 || argc > 4)
+		usage();
+	if (argc > 2)
+		depth = strtoul(argv[2], NULL, 10);
+	if (argc > 3) {
+		if (0 > ai_config_load(&config, argv[3])) {
+			fprintf(stderr, "error: Could not read AI weights from %s\n", argv[3]);
+			return EXIT_FAILURE;
+		}
+	} else {
+		hidamari_init(&game, NULL);
+		config = *hidamari_ai_config(&game);
+	}
+	/* The book must come from searching */
+	config.book = NULL;
+
+	/* Each position has a successor per shape, and there are four first
+	 * hidamaries with any next one */
+	for (n = 0, i = 4 * HIDAMARI_LAST, d = 0; d < depth; ++d) {
+		n += i;
+		i *= HIDAMARI_LAST;
+	}
+	region = region_borrow(ai_size_requirement());
+	if (!region || 0 > KeySet_reserve(&seen, n))
+		out_of_memory();
+
+	/* The first hidamari is never an S, Z or O */
+	field_init(&field, 1);
+	for (s = 0; s < HIDAMARI_LAST; ++s) {
+		if (HIDAMARI_O == s || HIDAMARI_S == s || HIDAMARI_Z == s)
+			continue;
+		for (t = 0; t < HIDAMARI_LAST; ++t) {
+			field.current.shape = s;
+			field.next = t;
+			if (0 > FieldVec_push(&level, field))
+				out_of_memory();
+		}
+	}
+	for (d = 0; d < depth; ++d) {
+		next.len = 0;
+		for (i = 0; i < level.len; ++i) {
+			if (see(book_key(&level.data[i], &mirrored)))
+				continue;
+			region_clear(region);
+			field = level.data[i];
+			state = play(&field,
+					ai_plan(region, &config, &level.data[i]),
+					&placed);
+			book_entry(&level.data[i], &placed, &e);
+			if (0 > EntryVec_push(&entry, e))
+				out_of_memory();
+			if (HIDAMARI_GS_GAME_OVER == state || d + 1 == depth)
+				continue;
+			for (t = 0; t < HIDAMARI_LAST; ++t) {
+				field.next = t;
+				if (0 > FieldVec_push(&next, field))
+					out_of_memory();
+			}
+		}
+		fprintf(stderr, "depth %zu: %zu positions, %zu entries\n",
+				d + 1, level.len, entry.len);
+		tmp = level;
+		level = next;
+		next = tmp;
+	}
+	region_return(region);
+
+	if (0 > book_write(argv[1], entry.data, entry.len)) {
+		fprintf(stderr, "error: Could not write %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	EntryVec_free(&entry);
+	FieldVec_free(&level);
+	FieldVec_free(&next);
+	KeySet_free(&seen);
+	return 0;
+}
@@ -0,0 +1,111 @@
+/* See LICENSE file for copyright and license details */
+#include <stdlib.h>
+#include <string.h>
+
+#include "compose.h"
+#include "hidamari.h"
+
+/* Two pixels, widened to 16 bits a channel for the color modulation. This
+ * fits a single SSE2 or NEON register, and wider targets unroll it. */
+typedef u8 Pixels __attribute__((vector_size(8)));
+typedef uint16_t Channels __attribute__((vector_size(16)));
+
+/* Divide each channel by 255, rounding to nearest, for products of two
+ * 8-bit values */
+static inline Channels
+div255(Channels v)
+{
+	v += 128;
+	return (v + (v >> 8)) >> 8;
+}
+
+int
+compose_tileset_init(ComposeTileset *tileset, u8 const *rgba, size_t w,
+		size_t h, size_t pitch, size_t tile)
+{
+	size_t i, x, y, c;
+	u8 const *src;
+	u8 *dst;
+
+	if (0 == tile || 0 != tile % 2)
+		return -1;
+	tileset->tile = tile;
+	tileset->n_tile = (w / tile) * (h / tile);
+	/* The glyph after the last is left blank, for space tiles */
+	tileset->glyph = calloc(tileset->n_tile + 1, tile * tile * 4);
+	if (!tileset->glyph)
+		return -1;
+	for (i = 0; i < tileset->n_tile; ++i) {
+		dst = tileset->glyph + i * tile * tile * 4;
+		for (y = 0; y < tile; ++y) {
+			src = rgba + ((i / (w / tile)) * tile + y) * pitch
+				+ (i % (w / tile)) * tile * 4;
+			for (x = 0; x < tile; ++x, src += 4, dst += 4) {
+				for (c = 0; c < 3; ++c) {
+					dst[c] = (src[c] * src[3] + 127) / 255;
+				}
+				dst[3] = src[3];
+			}
+		}
+	}
+	return 0;
+}
+
+void
+compose_tileset_free(ComposeTileset *tileset)
+{
+	free(tileset->glyph);
+	tileset->glyph = NULL;
+}
+
+/* Copy a glyph into the framebuffer, multiplying its color channels by
+ * _mod_. The glyph is premultiplied, so over the black background only its
+ * color needs scaling, and the result is made opaque. */
+static void
+blit(ComposeTileset const *tileset, u8 const *glyph, u8 *dst, size_t pitch,
+		Channels mod)
+{
+	static Pixels const opaque = {0, 0, 0, 255, 0, 0, 0, 255};
+	size_t x, y;
+	size_t row = tileset->tile * 4;
+	Pixels p;
+
+	for (y = 0; y < tileset->tile; ++y, dst += pitch, glyph += row) {
+		for (x = 0; x < row; x += sizeof(p)) {
+			memcpy(&p, glyph + x, sizeof(p));
+			p = __builtin_convertvector(div255(
+					__builtin_convertvector(p, Channels) * mod),
+					Pixels) | opaque;
+			memcpy(dst + x, &p, sizeof(p));
+		}
+	}
+}
+
+void
+compose(ComposeTileset const *tileset, HidamariBuffer const *buf, u8 *fb,
+		size_t pitch)
+{
+	size_t x, y, t;
+	size_t tile = tileset->tile;
+	size_t glyph_size = tile * tile * 4;
+	u8 const *color;
+	u8 const *glyph;
+	Channels mod;
+
+	/* Walk the framebuffer in order, from its top row of tiles down */
+	for (y = HIDAMARI_BUFFER_HEIGHT; y-- > 0;) {
+		for (x = 0; x < HIDAMARI_BUFFER_WIDTH; ++x) {
+			t = buf->tile[x][y];
+			color = buf->color[x][y];
+			if (HIDAMARI_TILE_SPACE == t || t >= tileset->n_tile)
+				t = tileset->n_tile;
+			glyph = tileset->glyph + t * glyph_size;
+			mod = (Channels){
+				color[0], color[1], color[2], 255,
+				color[0], color[1], color[2], 255,
+			};
+			blit(tileset, glyph, fb + (HIDAMARI_BUFFER_HEIGHT - 1 - y)
+					* tile * pitch + x * tile * 4, pitch, mod);
+		}
+	}
+}
@@ -0,0 +1,45 @@
+/* See LICENSE file for copyright and license details */
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* A software compositor drawing a HidamariBuffer into an RGBA framebuffer,
+ * so that a frame can be displayed with a single texture upload. Pixels
+ * are 4 bytes in R, G, B, A order, and the framebuffer is opaque. */
+
+/* A tileset of square glyphs laid out 16 to a row, with each glyph stored
+ * contiguously as premultiplied RGBA */
+typedef struct {
+	size_t tile; /* Width and height of a glyph in pixels */
+	size_t n_tile;
+	u8 *glyph;
+} ComposeTileset;
+
+/* Width and height in pixels of the framebuffer for glyphs of size _tile_ */
+#define COMPOSE_WIDTH(tile) (HIDAMARI_BUFFER_WIDTH * (tile))
+#define COMPOSE_HEIGHT(tile) (HIDAMARI_BUFFER_HEIGHT * (tile))
+
+/* Load a tileset from an RGBA image of _w_ by _h_ pixels, with _pitch_
+ * bytes from one row to the next. _tile_ must be even.
+ *
+ * Return: 0 on success, or -1 if _tile_ is unsuitable or out of memory.
+ */
+int
+compose_tileset_init(ComposeTileset *tileset, u8 const *rgba, size_t w,
+		size_t h, size_t pitch, size_t tile);
+
+void
+compose_tileset_free(ComposeTileset *tileset);
+
+/* Draw every tile of _buf_ into _fb_, tinted by its color, with
+ * HIDAMARI_TILE_SPACE left black. Row 0 of the buffer is the bottom row of
+ * the framebuffer, which has _pitch_ bytes from one row to the next.
+ */
+void
+compose(ComposeTileset const *tileset, HidamariBuffer const *buf, u8 *fb,
+		size_t pitch);
+
+#endif
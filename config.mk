@@ -8,9 +8,35 @@ LIBPREFIX := $(PREFIX)/lib
 MANPREFIX := $(PREFIX)/man
 
 # Linking flags
-LDFLAGS := -lSDL2 -lSDL2_image -lpthread -lm
+LDFLAGS := -lpthread -lm -lrt
+SDL_LDFLAGS := -lSDL2 -lSDL2_image
+PNG_LDFLAGS := -lpng
 
 # C Compiler settings
 CC := cc
-CFLAGS := -O2 -I. -std=gnu11 -pedantic -Wall -Wextra
-CFLAGS += -O0 -g
+CFLAGS := -I. -std=gnu11 -pedantic -Wall -Wextra
+# Keep the performance counters of telemetry.h, comment out to compile them out
+CFLAGS += -DHIDAMARI_TELEMETRY
+
+# Size of the board, including the walls on either side and the floor.
+# For example, BOARD_HEIGHT=43 gives a 10x40 board.
+BOARD_WIDTH := 12
+BOARD_HEIGHT := 23
+CFLAGS += -DHIDAMARI_WIDTH=$(BOARD_WIDTH) -DHIDAMARI_HEIGHT=$(BOARD_HEIGHT)
+
+# Flags of each build variant
+debug_CFLAGS := -O0 -g
+release_CFLAGS := -O2 -DNDEBUG
+lto_CFLAGS := $(release_CFLAGS) -flto=auto
+lto_LDFLAGS := -flto=auto
+pgo_CFLAGS := $(lto_CFLAGS)
+pgo_LDFLAGS := $(lto_LDFLAGS)
+
+# Flags of the two stages of a profile-guided build
+pgo_generate_CFLAGS := -fprofile-generate -fprofile-update=atomic
+pgo_generate_LDFLAGS := -fprofile-generate
+pgo_use_CFLAGS := -fprofile-use -fprofile-correction -Wno-missing-profile
+
+# Arguments of the headless benchmark run to train a profile-guided build:
+# number of games, lines per game and seed
+PGO_TRAIN := 8 300 1
@@ -32,14 +32,15 @@ int
 main()
 {
 	HidamariGame game;
+	HidamariBuffer buf;
 
 	srand(time(NULL));
-	hidamari_init(&game);
+	hidamari_init(&game, &buf);
 	for (;;) {
 		printf("top-right: %d, %d\n",
 				game.field.current.pos.x,
 				game.field.current.pos.y);
-		dump_field(&game.buf);
+		dump_field(game.buf);
 		hidamari_update(&game, BUTTON_NONE);
 	}
 	return 0;
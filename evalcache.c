@@ -0,0 +1,209 @@
+/* See LICENSE file for copyright and license details */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evalcache.h"
+#include "hidamari.h"
+
+#define LEN(a) (sizeof(a) / sizeof(*(a)))
+
+#define BUCKET_ENTRIES 4
+/* Epochs an entry goes unused before a hit refreshes it */
+#define REFRESH_AGE 2
+
+/* Layout of a result word. The valid bit keeps every result nonzero, so
+ * an empty entry matches no key. */
+#define SCORE_MASK 0xffffffffULL
+#define X_SHIFT 32
+#define Y_SHIFT 40
+#define SHAPE_SHIFT 48
+#define ORIENTATION_SHIFT 51
+#define VALID_BIT (1ULL << 54)
+#define EPOCH_SHIFT 56
+
+typedef struct {
+	_Atomic u64 check; /* Key xor result */
+	_Atomic u64 result;
+} Entry;
+
+typedef struct {
+	_Alignas(64) Entry entry[BUCKET_ENTRIES];
+} Bucket;
+
+static Bucket *table;
+static size_t n_bucket; /* A power of two */
+static u64 epoch_inserts; /* Inserts an epoch lasts */
+static _Atomic u64 n_insert;
+
+static u64
+mix(u64 h, u64 v)
+{
+	h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static u64
+key(HidamariAIConfig const *config, HidamariPlayField const *field)
+{
+	int y;
+	size_t i;
+	u32 gravity;
+	u64 w, h = config->n_weight;
+
+	for (i = 0; i < config->n_weight; ++i) {
+		memcpy(&w, &config->weight[i], sizeof(w));
+		h = mix(h, w);
+	}
+	h = mix(h, (uintptr_t)config->mlp);
+	h = mix(h, (u64)config->n_playout << 32 | config->playout_depth);
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		h = mix(h, field->grid[y]);
+	}
+	memcpy(&gravity, &field->gravity_timer, sizeof(gravity));
+	h = mix(h, (u64)gravity << 32 | field->level << 8 | field->slide_timer);
+	h = mix(h, field->lines);
+	h = mix(h, (u64)(u32)field->current.pos.x << 32
+			| (u32)field->current.pos.y);
+	h = mix(h, field->current.shape << 16 | field->current.orientation << 8
+			| field->next);
+	if (config->n_playout > 0) {
+		h = mix(h, (u64)field->rng << 32 | field->pieces);
+		h = mix(h, field->bag_pos);
+		for (i = 0; i < LEN(field->bag); ++i) {
+			h = mix(h, field->bag[i]);
+		}
+	}
+	/* Zero is the key of no entry */
+	return h | 1;
+}
+
+static Entry *
+bucket(u64 k)
+{
+	/* The lowest bit of a key is always set */
+	return table[k >> 1 & (n_bucket - 1)].entry;
+}
+
+static u8
+epoch(void)
+{
+	return atomic_load_explicit(&n_insert, memory_order_relaxed)
+		/ epoch_inserts;
+}
+
+static u64
+pack(Hidamari const *placed, f32 score, u8 now)
+{
+	u32 s;
+
+	memcpy(&s, &score, sizeof(s));
+	return s | (u64)(u8)placed->pos.x << X_SHIFT
+		| (u64)(u8)placed->pos.y << Y_SHIFT
+		| (u64)placed->shape << SHAPE_SHIFT
+		| (u64)placed->orientation << ORIENTATION_SHIFT
+		| VALID_BIT | (u64)now << EPOCH_SHIFT;
+}
+
+/* Replace _e_, last seen holding _check_, unless another thread got to it
+ * first */
+static void
+replace(Entry *e, u64 check, u64 k, u64 result)
+{
+	if (atomic_compare_exchange_strong_explicit(&e->check, &check,
+			k ^ result, memory_order_relaxed, memory_order_relaxed))
+		atomic_store_explicit(&e->result, result, memory_order_relaxed);
+}
+
+int
+evalcache_init(size_t n_entry)
+{
+	evalcache_free();
+	for (n_bucket = 1; n_bucket * BUCKET_ENTRIES < n_entry; n_bucket *= 2)
+		;
+	table = aligned_alloc(_Alignof(Bucket), n_bucket * sizeof(*table));
+	if (!table)
+		return -1;
+	memset(table, 0, n_bucket * sizeof(*table));
+	epoch_inserts = n_bucket * BUCKET_ENTRIES / 4;
+	atomic_init(&n_insert, 0);
+	return 0;
+}
+
+void
+evalcache_free(void)
+{
+	free(table);
+	table = NULL;
+}
+
+bool
+evalcache_probe(HidamariAIConfig const *config, HidamariPlayField const *field,
+		Hidamari *placed, double *score)
+{
+	int i;
+	u8 now;
+	u64 k, check, result;
+	f32 s;
+	u32 bits;
+	Entry *e;
+
+	if (!table)
+		return false;
+	k = key(config, field);
+	for (i = 0; i < BUCKET_ENTRIES; ++i) {
+		e = &bucket(k)[i];
+		result = atomic_load_explicit(&e->result, memory_order_relaxed);
+		check = atomic_load_explicit(&e->check, memory_order_relaxed);
+		if ((check ^ result) != k)
+			continue;
+		placed->pos.x = (int8_t)(result >> X_SHIFT);
+		placed->pos.y = (int8_t)(result >> Y_SHIFT);
+		placed->shape = result >> SHAPE_SHIFT & 7;
+		placed->orientation = result >> ORIENTATION_SHIFT & 3;
+		bits = result & SCORE_MASK;
+		memcpy(&s, &bits, sizeof(s));
+		*score = s;
+		now = epoch();
+		if ((u8)(now - (result >> EPOCH_SHIFT)) >= REFRESH_AGE)
+			replace(e, check, k, (result & ~(0xffULL << EPOCH_SHIFT))
+					| (u64)now << EPOCH_SHIFT);
+		return true;
+	}
+	return false;
+}
+
+void
+evalcache_store(HidamariAIConfig const *config, HidamariPlayField const *field,
+		Hidamari const *placed, double score)
+{
+	int i, victim = 0, age, oldest = -1;
+	u8 now;
+	u64 k, check[BUCKET_ENTRIES], result;
+	Entry *e;
+
+	if (!table)
+		return;
+	k = key(config, field);
+	e = bucket(k);
+	now = epoch();
+	/* Take the entry already holding the key, else an empty one, else
+	 * the one used the longest ago */
+	for (i = 0; i < BUCKET_ENTRIES; ++i) {
+		result = atomic_load_explicit(&e[i].result, memory_order_relaxed);
+		check[i] = atomic_load_explicit(&e[i].check, memory_order_relaxed);
+		if ((check[i] ^ result) == k) {
+			victim = i;
+			break;
+		}
+		age = result ? (u8)(now - (result >> EPOCH_SHIFT)) : 256;
+		if (age > oldest) {
+			oldest = age;
+			victim = i;
+		}
+	}
+	replace(&e[victim], check[victim], k, pack(placed, score, now));
+	atomic_fetch_add_explicit(&n_insert, 1, memory_order_relaxed);
+}
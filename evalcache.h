@@ -0,0 +1,57 @@
+/* See LICENSE file for copyright and license details */
+#ifndef EVALCACHE_H
+#define EVALCACHE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* A process-wide cache of search results, shared by every thread, so that
+ * positions searched before with the same weights, as in the early moves
+ * of many games, are not searched again. It is off until evalcache_init()
+ * is called.
+ *
+ * A position is keyed by a hash of everything the search reads from the
+ * playfield, and of the weights and other settings of the search, so every
+ * set of weights has its own entries. The playouts are seeded from the
+ * generator, so with them on the bag and its generator are part of the
+ * key as well.
+ *
+ * The table is a fixed array of buckets of 4 entries, one cache line each.
+ * Lookups only read. Inserts and refreshes replace an entry with a compare
+ * and swap, and never wait. Each entry is two words, the result and the
+ * key xor the result, so a lookup that races an insert sees a mismatch
+ * and misses instead of reading half of each. An insert evicts the entry
+ * of its bucket that was used the longest ago, counted in epochs that
+ * advance every quarter of the capacity in inserts. Entries are refreshed
+ * at most once an epoch, so the ones every thread hits are not written
+ * over and over. */
+
+/* Make room for about _n_entry_ search results, dropping any held before.
+ * Not safe to call while other threads use the cache.
+ *
+ * Return: 0 on success, -1 if out of memory.
+ */
+int
+evalcache_init(size_t n_entry);
+
+void
+evalcache_free(void);
+
+/* Look up the search result of _field_ with _config_.
+ *
+ * Return: true and the placement of the current hidamari and the score of
+ *	the leaf it aimed for if the cache has them.
+ */
+bool
+evalcache_probe(HidamariAIConfig const *config, HidamariPlayField const *field,
+		Hidamari *placed, double *score);
+
+/* Remember _placed_ and its _score_ as the search result of _field_ with
+ * _config_. The score is kept in single precision. */
+void
+evalcache_store(HidamariAIConfig const *config, HidamariPlayField const *field,
+		Hidamari const *placed, double score);
+
+#endif
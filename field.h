@@ -0,0 +1,82 @@
+/* See LICENSE file for copyright and license details */
+#ifndef FIELD_H
+#define FIELD_H
+
+#include <stdbool.h>
+
+#include "hidamari.h"
+
+/* Playfield primitives shared between the game and the AI. These are
+ * implemented in hidamari.c. */
+
+/* Character representations of each hidamari, indexed by shape */
+extern char const hidamari_shape_char[HIDAMARI_LAST];
+
+/* Reset the playfield to an empty board, with the piece sequence
+ * determined by _seed_ */
+void
+field_init(HidamariPlayField *field, u32 seed);
+
+/* Apply a single action and one tick of gravity to the current hidamari
+ * without locking it. Returns true if the hidamari is due to lock.
+ */
+bool
+field_move(HidamariPlayField *field, Button act);
+
+/* Lock the current hidamari in place and bring the next one into play.
+ *
+ * Return: HIDAMARI_GS_GAME_OVER if the new hidamari tops out, otherwise
+ *	HIDAMARI_GS_GAME_PLAYING.
+ */
+int
+field_lock(HidamariPlayField *field);
+
+/* Drop _t_, the current hidamari in another orientation or column, straight
+ * down from where it is and lock it there, without any timesteps passing.
+ * _t_ is updated to where it landed.
+ *
+ * Return: -1 if _t_ collides where it starts, otherwise as field_lock().
+ */
+int
+field_place(HidamariPlayField *field, Hidamari *t);
+
+/* Advance the playfield by one timestep with the given action */
+int
+field_update(HidamariPlayField *field, Button act);
+
+/* Compute the grid coordinates of the four cells of a hidamari */
+void
+field_cells(Hidamari const *t, Vec2 cell[4]);
+
+/* Fill in the shapes of the next _n_ hidamaries to come into play, the
+ * current one first, following the bag and its generator */
+void
+field_preview(HidamariPlayField const *field, HidamariShape shape[], size_t n);
+
+/* Check if two hidamaries occupy exactly the same cells */
+bool
+field_same_cells(Hidamari const *a, Hidamari const *b);
+
+/* Number of occupied cells of a row */
+static inline int
+row_popcount(HidamariRow row)
+{
+#if HIDAMARI_WIDTH <= 32
+	return __builtin_popcount(row);
+#else
+	return __builtin_popcountll(row);
+#endif
+}
+
+/* Column of the lowest occupied cell of a row, which must not be empty */
+static inline int
+row_ctz(HidamariRow row)
+{
+#if HIDAMARI_WIDTH <= 32
+	return __builtin_ctz(row);
+#else
+	return __builtin_ctzll(row);
+#endif
+}
+
+#endif
@@ -8,19 +8,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdatomic.h>
+#include <time.h>
 
 #include "ai.h"
+#include "field.h"
 #include "hidamari.h"
 #include "region.h"
+#include "telemetry.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/* The scoreboard and menus are drawn inside the board */
+_Static_assert(HIDAMARI_WIDTH >= 12, "the scoreboard needs 10 columns");
+_Static_assert(HIDAMARI_HEIGHT >= 12, "the menus need more rows");
+
 static f32 const drop_time = 1.0;
 static u8 const slide_time = 15;
 
 static void
-r7system(HidamariShape bag[7]);
+r7system(HidamariShape bag[7], u32 *rng);
 
 /* Gravity of the falling piece at certain levels */
 static f32 gravity_level[15] = {
@@ -41,6 +48,14 @@ static f32 gravity_level[15] = {
 	2.36
 };
 
+/* Weights of the AI heuristics for each skill level */
+static HidamariAIConfig const ai_preset[HIDAMARI_AI_LAST] = {
+	[HIDAMARI_AI_POOR] = {3, {28.586806, 77.649833, 61.638933}},
+	[HIDAMARI_AI_NORMAL] = {3, {1.487517, 4.727170, 3.072305}},
+	[HIDAMARI_AI_SKILLED] = {3, {0.3146738, 1, 0.649924}},
+	[HIDAMARI_AI_GODLIKE] = {3, {0.848058, 2.304684, 1.405450}},
+};
+
 /* Character representations of each hidamari */
 char const hidamari_shape_char[HIDAMARI_LAST] =
 {
@@ -219,7 +234,7 @@ draw_field(HidamariBuffer *buf, size_t x_offset, size_t y_offset, HidamariPlayFi
 		buf_set(buf, x_offset + HIDAMARI_WIDTH - 1, y_offset + y, HIDAMARI_TILE_WALL, NULL);
 	}
 
-	for (x = 1; x < HIDAMARI_BUFFER_WIDTH - 1; ++x) {
+	for (x = 1; x < HIDAMARI_WIDTH - 1; ++x) {
 		buf_set(buf, x_offset + x, y_offset, HIDAMARI_TILE_WALL, NULL);
 	}
 
@@ -254,7 +269,7 @@ draw_field(HidamariBuffer *buf, size_t x_offset, size_t y_offset, HidamariPlayFi
 	}
 
 	/* Draw the scoreboard */
-	snprintf((char *)score, sizeof(score) + 1, "%010d", field->score);
+	snprintf((char *)score, sizeof(score), "%0*u", HIDAMARI_WIDTH - 2, field->score);
 	for (x = 1; x < HIDAMARI_WIDTH_VISIBLE - 1; ++x) {
 		for (y = HIDAMARI_HEIGHT_VISIBLE; y < HIDAMARI_HEIGHT_VISIBLE + 3; ++y) {
 			if (HIDAMARI_HEIGHT_VISIBLE + 1 == y) {
@@ -267,7 +282,7 @@ draw_field(HidamariBuffer *buf, size_t x_offset, size_t y_offset, HidamariPlayFi
 	/* Draw the playfield */
 	for (x = 1; x < HIDAMARI_WIDTH_VISIBLE - 1; ++x) {
 		for (y = y_offset + 1; y < y_offset + HIDAMARI_HEIGHT_VISIBLE; ++y) {
-			if (field->grid[y] & 1 << x) {
+			if (field->grid[y] & (HidamariRow)1 << x) {
 				buf_set(buf, x_offset + x, y_offset +y, HIDAMARI_TILE_FALLEN, NULL);
 			} else {
 				buf_set(buf, x_offset + x, y_offset + y, HIDAMARI_TILE_SPACE, NULL);
@@ -386,7 +401,7 @@ clear_lines(HidamariPlayField *field)
 	size_t score;
 
 	while (y < HIDAMARI_HEIGHT) {
-		if (2046 == (field->grid[y] & 2046)) {
+		if (HIDAMARI_ROW_INNER == (field->grid[y] & HIDAMARI_ROW_INNER)) {
 			shift_lines(field, y);
 			combo += 1;
 		} else {
@@ -448,7 +463,7 @@ clear_lines(HidamariPlayField *field)
 static bool
 is_game_over(HidamariPlayField *field)
 {
-	if (field->grid[HIDAMARI_HEIGHT - 1] & 2046)
+	if (field->grid[HIDAMARI_HEIGHT - 1] & HIDAMARI_ROW_INNER)
 		return true;
 	return false;
 }
@@ -459,11 +474,11 @@ get_next_hidamari(HidamariPlayField *field)
 {
 	field->current.shape = field->next;
 	field->current.orientation = 0;
-	field->current.pos.x = 10 / 2 - 1;
+	field->current.pos.x = (HIDAMARI_WIDTH - 2) / 2 - 1;
 	field->current.pos.y = HIDAMARI_HEIGHT - 1;
 
 	if (field->bag_pos >= 7) {
-		r7system(field->bag);
+		r7system(field->bag, &field->rng);
 		field->bag_pos = 0;
 	}
 	field->next = field->bag[field->bag_pos];
@@ -472,7 +487,7 @@ get_next_hidamari(HidamariPlayField *field)
 
 /* Check if the Hidamari would collide in the given grid, at the given x,y coordinates */
 static bool
-is_collision(Hidamari const *t, u12 const grid[HIDAMARI_HEIGHT])
+is_collision(Hidamari const *t, HidamariRow const grid[HIDAMARI_HEIGHT])
 {
 	int i;
 	int x, y;
@@ -485,7 +500,7 @@ is_collision(Hidamari const *t, u12 const grid[HIDAMARI_HEIGHT])
 		                                   [i].y;
 		if (y < 0 || y > HIDAMARI_HEIGHT - 1
 		|| x < 0 || x > HIDAMARI_WIDTH - 1
-		|| (1 << x) & grid[y])
+		|| ((HidamariRow)1 << x) & grid[y])
 			return true;
 	}
 	return false;
@@ -493,13 +508,14 @@ is_collision(Hidamari const *t, u12 const grid[HIDAMARI_HEIGHT])
 
 /* Lock the current piece in place by copying it to the static piece grid */
 static void
-lock_hidamari(u12 recv[HIDAMARI_HEIGHT], Hidamari const *hidamari)
+lock_hidamari(HidamariRow recv[HIDAMARI_HEIGHT], Hidamari const *hidamari)
 {
 	int i;
-	u12 x, y;
+	int y;
+	HidamariRow x;
 
 	for (i = 0; i < 4; ++i) {
-		x = 1 << (hidamari_orientation[hidamari->shape]
+		x = (HidamariRow)1 << (hidamari_orientation[hidamari->shape]
 		                              [hidamari->orientation]
 		                              [i].x + hidamari->pos.x);
 		y = hidamari->pos.y
@@ -532,9 +548,20 @@ move_current(HidamariPlayField *field, Button dir)
 	return true;
 }
 
+/* Advance a xorshift generator, so that every playfield has its own
+ * reproducible piece sequence */
+static u32
+next_random(u32 *rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 17;
+	*rng ^= *rng << 5;
+	return *rng;
+}
+
 /* Standard Tetris Random Hidamari generator. */
 static void
-r7system(HidamariShape bag[7])
+r7system(HidamariShape bag[7], u32 *rng)
 {
 	int i;
 	int r1;
@@ -549,8 +576,8 @@ r7system(HidamariShape bag[7])
 	bag[5] = HIDAMARI_T;
 	bag[6] = HIDAMARI_Z;
 	for (i = 0; i < 7; ++i) {
-		r1 = rand() % 7;
-		r2 = rand() % 7;
+		r1 = next_random(rng) % 7;
+		r2 = next_random(rng) % 7;
 		tmp = bag[r1];
 		bag[r1] = bag[r2];
 		bag[r2] = tmp;
@@ -575,32 +602,33 @@ rotate_current(HidamariPlayField *field, Button dir)
 }
 
 void
-field_init(HidamariPlayField *field)
+field_init(HidamariPlayField *field, u32 seed)
 {
 	size_t i;
 
 	memset(field, 0, sizeof(*field));
+	/* Xorshift never leaves a zero state */
+	field->rng = seed ? seed : 1;
 	/* Initialize the random bag */
-	r7system(field->bag);
+	r7system(field->bag, &field->rng);
 	/* First hidamari must not be a S, Z, or O */
 	do {
-		field->next = rand() % 7;
+		field->next = next_random(&field->rng) % 7;
 	} while (HIDAMARI_O == field->next
 	      || HIDAMARI_S == field->next
 	      || HIDAMARI_Z == field->next);
 	get_next_hidamari(field);
 	/* Initialize the borders */
-	field->grid[0] |= 4095;
+	field->grid[0] = HIDAMARI_ROW_FULL;
 	for (i = 1; i < HIDAMARI_HEIGHT; ++i) {
-		field->grid[i] = 2049;
+		field->grid[i] = HIDAMARI_ROW_WALLS;
 	}
 }
 
-int
-field_update(HidamariPlayField *field, Button act)
+/* Perform an action on the current hidamari, without any gravity */
+static void
+act_current(HidamariPlayField *field, Button act)
 {
-	Hidamari tmp;
-
 	switch (act) {
 	case BUTTON_NONE:
 		break;
@@ -622,7 +650,14 @@ field_update(HidamariPlayField *field, Button act)
 		/* Don't perform any action for an illegal action */
 		break;
 	}
+}
+
+bool
+field_move(HidamariPlayField *field, Button act)
+{
+	Hidamari tmp;
 
+	act_current(field, act);
 	field->gravity_timer += gravity_level[field->level];
 	
 	if (field->gravity_timer >= drop_time) {
@@ -635,17 +670,116 @@ field_update(HidamariPlayField *field, Button act)
 		if (field->slide_timer < slide_time) {
 			field->slide_timer += 1;
 		} else {
-			lock_hidamari(field->grid, &field->current);
-			clear_lines(field);
-			get_next_hidamari(field);
-			field->slide_timer = 0;
-			if (is_game_over(field))
-				return HIDAMARI_GS_GAME_OVER;
+			return true;
 		}
 	}
+	return false;
+}
+
+int
+field_lock(HidamariPlayField *field)
+{
+	lock_hidamari(field->grid, &field->current);
+	field->pieces += 1;
+	clear_lines(field);
+	get_next_hidamari(field);
+	field->slide_timer = 0;
+	if (is_game_over(field))
+		return HIDAMARI_GS_GAME_OVER;
 	return HIDAMARI_GS_GAME_PLAYING;
 }
 
+int
+field_place(HidamariPlayField *field, Hidamari *t)
+{
+	if (is_collision(t, field->grid))
+		return -1;
+	do {
+		t->pos.y -= 1;
+	} while (!is_collision(t, field->grid));
+	t->pos.y += 1;
+	field->current = *t;
+	return field_lock(field);
+}
+
+int
+field_update(HidamariPlayField *field, Button act)
+{
+	if (field_move(field, act))
+		return field_lock(field);
+	return HIDAMARI_GS_GAME_PLAYING;
+}
+
+void
+field_cells(Hidamari const *t, Vec2 cell[4])
+{
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		cell[i].x = hidamari_orientation[t->shape][t->orientation][i].x
+			+ t->pos.x;
+		cell[i].y = t->pos.y
+			- hidamari_orientation[t->shape][t->orientation][i].y;
+	}
+}
+
+void
+field_preview(HidamariPlayField const *field, HidamariShape shape[], size_t n)
+{
+	size_t i;
+	u32 rng = field->rng;
+	unsigned pos = field->bag_pos;
+	HidamariShape bag[7];
+
+	memcpy(bag, field->bag, sizeof(bag));
+	for (i = 0; i < n; ++i) {
+		if (0 == i) {
+			shape[i] = field->current.shape;
+		} else if (1 == i) {
+			shape[i] = field->next;
+		} else {
+			if (pos >= 7) {
+				r7system(bag, &rng);
+				pos = 0;
+			}
+			shape[i] = bag[pos++];
+		}
+	}
+}
+
+bool
+field_same_cells(Hidamari const *a, Hidamari const *b)
+{
+	int i, j;
+	Vec2 ca[4], cb[4];
+
+	if (a->shape != b->shape)
+		return false;
+	field_cells(a, ca);
+	field_cells(b, cb);
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < 4; ++j) {
+			if (ca[i].x == cb[j].x && ca[i].y == cb[j].y)
+				break;
+		}
+		if (4 == j)
+			return false;
+	}
+	return true;
+}
+
+/* Forget any plan left over from a previous game */
+static void
+start_game(HidamariGame *game, u32 seed)
+{
+	field_init(&game->field, seed);
+	game->ai.plan[0] = BUTTON_NONE;
+	game->ai.plan_pos = 0;
+	game->piece_ticks = 0;
+	memset(&game->stats, 0, sizeof(game->stats));
+	game->stats.seed = seed;
+}
+
 int
 main_menu(HidamariGame *game, Button act)
 {
@@ -665,7 +799,7 @@ main_menu(HidamariGame *game, Button act)
 		case BUTTON_B:
 			switch (*cursor) {
 			case 0:
-				field_init(&game->field);
+				start_game(game, rand());
 				return HIDAMARI_GS_GAME_PLAYING;
 			case 1:
 				return HIDAMARI_GS_OPTION_MENU;
@@ -707,71 +841,119 @@ option_menu(HidamariGame *game, Button act)
 	return HIDAMARI_GS_OPTION_MENU;
 }
 
-/*
- * Public API
- */
+/* Lock the current hidamari of a game, counting the lines it clears at once
+ * in the statistics */
+static int
+lock_game(HidamariGame *game)
+{
+	int state;
+	u32 lines = game->field.lines;
 
-void
-hidamari_init(HidamariGame *game)
+	state = field_lock(&game->field);
+	if (game->field.lines != lines)
+		game->stats.clears[MIN(game->field.lines - lines, 4) - 1] += 1;
+	return state;
+}
+
+/* As field_update(), on the playfield of a game */
+static int
+update_game(HidamariGame *game, Button act)
+{
+	if (field_move(&game->field, act))
+		return lock_game(game);
+	return HIDAMARI_GS_GAME_PLAYING;
+}
+
+/* Feed the next planned input to the playfield, planning first if the
+ * previous plan has run out. The region is only borrowed while planning. */
+static int
+play_ai(HidamariGame *game, HidamariAIConfig const *config)
 {
-	static Button const dbv = BUTTON_NONE;
+	void *region;
 
-	memset(game, 0, sizeof(*game));
-	game->state = HIDAMARI_GS_MAIN_MENU;
-	game->ai.region = region_create(ai_size_requirement());
-	game->ai.planstr = &dbv;
-	game->ai.active = false;
-	game->ai.skill = HIDAMARI_AI_GODLIKE;
+	if (hidamari_needs_plan(game)) {
+		region = region_borrow(ai_size_requirement());
+		hidamari_plan(game, region, config);
+		region_return(region);
+	}
+	game->ai.plan_pos += 1;
+	return update_game(game, game->ai.plan[game->ai.plan_pos - 1]);
 }
 
-void
-hidamari_update(HidamariGame *game, Button act)
+/* Perform the actions of a player in order, then advance the playfield by
+ * one timestep. A hard drop locks its hidamari right away, so the actions
+ * after it apply to the next one. */
+static int
+play_human(HidamariGame *game, Button const *act, size_t n_act)
 {
-	double poor[3] = {28.586806, 77.649833, 61.638933};
-	double normal[3] = {1.487517, 4.727170, 3.072305};
-	double skilled[3] = {0.3146738, 1, 0.649924};
-	double godlike[3] = {0.848058, 2.304684, 1.405450};
+	size_t i;
 
-	double *weight = poor;
+	if (0 == n_act)
+		return update_game(game, BUTTON_NONE);
+	for (i = 0; i + 1 < n_act; ++i) {
+		act_current(&game->field, act[i]);
+		if (BUTTON_B == act[i]
+		    && HIDAMARI_GS_GAME_OVER == lock_game(game))
+			return HIDAMARI_GS_GAME_OVER;
+	}
+	return update_game(game, act[n_act - 1]);
+}
 
-	switch (game->ai.skill) {
-	case HIDAMARI_AI_POOR:
-		weight = poor;
-		break;
-	case HIDAMARI_AI_NORMAL:
-		weight = normal;
-		break;
-	case HIDAMARI_AI_SKILLED:
-		weight = skilled;
-		break;
-	case HIDAMARI_AI_GODLIKE:
-		weight = godlike;
-		break;
+/* Advance the playfield of a game by one timestep, with the AI playing if
+ * _config_ is given and the actions in _act_ otherwise. */
+static int
+step_field(HidamariGame *game, Button const *act, size_t n_act,
+		HidamariAIConfig const *config)
+{
+	int state;
+	u32 lines = game->field.lines;
+	u32 pieces = game->field.pieces;
+	u8 level = game->field.level;
+
+	if (config) {
+		state = play_ai(game, config);
+	} else {
+		state = play_human(game, act, n_act);
 	}
+	game->stats.ticks += 1;
+	for (; level < game->field.level; ++level) {
+		game->stats.level_pieces[level] = game->field.pieces;
+	}
+	game->piece_ticks += 1;
+	/* Lines only clear as a hidamari locks, so the shared counters are
+	 * only touched then */
+	if (pieces != game->field.pieces) {
+		telemetry_count(TELEMETRY_TICKS, game->piece_ticks);
+		telemetry_count(TELEMETRY_PIECES, game->field.pieces - pieces);
+		if (game->field.lines != lines)
+			telemetry_count(TELEMETRY_LINES, game->field.lines - lines);
+		telemetry_sample(TELEMETRY_HIST_PIECE_TICKS, game->piece_ticks);
+		game->piece_ticks = 0;
+	}
+	return state;
+}
+
+/* Advance the game by one timestep without drawing it */
+static void
+step_game(HidamariGame *game, Button const *act, size_t n_act)
+{
+	size_t i;
 
 	switch(game->state) {
 	case HIDAMARI_GS_MAIN_MENU:
-		game->state = main_menu(game, act);
-		draw_main_menu(&game->buf, game);
+		/* Inputs past the one leaving the menu are dropped */
+		for (i = 0; i < n_act && HIDAMARI_GS_MAIN_MENU == game->state; ++i) {
+			game->state = main_menu(game, act[i]);
+		}
 		break;
 	case HIDAMARI_GS_OPTION_MENU:
-		game->state = option_menu(game, act);
-		draw_option_menu(&game->buf, game);
+		for (i = 0; i < n_act && HIDAMARI_GS_OPTION_MENU == game->state; ++i) {
+			game->state = option_menu(game, act[i]);
+		}
 		break;
 	case HIDAMARI_GS_GAME_PLAYING:
-		if (game->ai.active) {
-			if (game->ai.planstr[0] == BUTTON_NONE) {
-				region_clear(game->ai.region);
-				game->ai.planstr = ai_plan(game->ai.region, weight, &game->field);
-			}
-			game->state = field_update(&game->field, game->ai.planstr[0]);
-			if (HIDAMARI_GS_GAME_OVER == game->state)
-				region_destroy(game->ai.region);
-			++game->ai.planstr;
-		} else {
-			game->state = field_update(&game->field, act);
-		}
-		draw_field(&game->buf, 6, 0, &game->field);
+		game->state = step_field(game, act, n_act, game->ai.active
+				? hidamari_ai_config(game) : NULL);
 		break;
 	case HIDAMARI_GS_GAME_OVER:
 		game->state = HIDAMARI_GS_MAIN_MENU;
@@ -779,16 +961,126 @@ hidamari_update(HidamariGame *game, Button act)
 	}
 }
 
+/* Draw the game into its buffer, if it has one, as it is shown in _state_.
+ * This is the state the last timestep began in, so the final position of a
+ * game is drawn once it is over. */
+static void
+draw_game(HidamariGame *game, HidamariGameState state)
+{
+	if (!game->buf)
+		return;
+	switch(state) {
+	case HIDAMARI_GS_MAIN_MENU:
+		draw_main_menu(game->buf, game);
+		break;
+	case HIDAMARI_GS_OPTION_MENU:
+		draw_option_menu(game->buf, game);
+		break;
+	case HIDAMARI_GS_GAME_PLAYING:
+		draw_field(game->buf, 6, 0, &game->field);
+		break;
+	}
+}
+
+/*
+ * Public API
+ */
+
 void
-hidamari_pso_update(HidamariGame *game, double weight[3])
+hidamari_init(HidamariGame *game, HidamariBuffer *buf)
 {
-	if (game->ai.planstr[0] == BUTTON_NONE) {
-		region_clear(game->ai.region);
-		game->ai.planstr = ai_plan(game->ai.region, weight, &game->field);
+	memset(game, 0, sizeof(*game));
+	game->buf = buf;
+	game->ai.active = false;
+	game->ai.skill = HIDAMARI_AI_GODLIKE;
+	hidamari_reset(game);
+}
+
+void
+hidamari_reset(HidamariGame *game)
+{
+	game->state = HIDAMARI_GS_MAIN_MENU;
+	game->cursor[HIDAMARI_MAIN_CURSOR] = 0;
+	game->cursor[HIDAMARI_OPTION_CURSOR] = 0;
+	memset(&game->field, 0, sizeof(game->field));
+	game->ai.plan[0] = BUTTON_NONE;
+	game->ai.plan_pos = 0;
+}
+
+void
+hidamari_update(HidamariGame *game, Button act)
+{
+	hidamari_update_inputs(game, &act, 1);
+}
+
+void
+hidamari_update_inputs(HidamariGame *game, Button const *act, size_t n_act)
+{
+	HidamariGameState state = game->state;
+
+	step_game(game, act, n_act);
+	draw_game(game, state);
+}
+
+size_t
+hidamari_run(HidamariGame *game, Button const *act, size_t n)
+{
+	size_t i;
+	Button none = BUTTON_NONE;
+	HidamariGameState state = game->state;
+
+	for (i = 0; i < n && state == game->state; ++i) {
+		step_game(game, act ? &act[i] : &none, 1);
 	}
-	if (0 != field_update(&game->field, game->ai.planstr[0])) {
-		game->state = HIDAMARI_GS_GAME_OVER;
-		region_destroy(game->ai.region);
+	draw_game(game, state);
+	return i;
+}
+
+void
+hidamari_start(HidamariGame *game, u32 seed)
+{
+	start_game(game, seed);
+	game->state = HIDAMARI_GS_GAME_PLAYING;
+}
+
+HidamariAIConfig const *
+hidamari_ai_config(HidamariGame const *game)
+{
+	if (game->ai.config)
+		return game->ai.config;
+	return &ai_preset[game->ai.skill];
+}
+
+bool
+hidamari_needs_plan(HidamariGame const *game)
+{
+	return BUTTON_NONE == game->ai.plan[game->ai.plan_pos];
+}
+
+void
+hidamari_plan(HidamariGame *game, void *region, HidamariAIConfig const *config)
+{
+	size_t i;
+	Button const *planstr;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	region_clear(region);
+	planstr = ai_plan(region, config, &game->field);
+	for (i = 0; i < HIDAMARI_PLAN_MAX - 1 && BUTTON_NONE != planstr[i]; ++i) {
+		game->ai.plan[i] = planstr[i];
 	}
-	++game->ai.planstr;
+	game->ai.plan[i] = BUTTON_NONE;
+	game->ai.plan_pos = 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	game->stats.plans += 1;
+	game->stats.plan_ns += (end.tv_sec - start.tv_sec) * 1000000000LL
+		+ (end.tv_nsec - start.tv_nsec);
+}
+
+void
+hidamari_pso_update(HidamariGame *game, HidamariAIConfig const *config)
+{
+	if (HIDAMARI_GS_GAME_PLAYING != step_field(game, NULL, 0, config))
+		game->state = HIDAMARI_GS_GAME_OVER;
 }
@@ -10,14 +10,37 @@
 
 #include "type.h"
 
+/* Size of the grid, including the walls on either side and the floor. Both
+ * can be set at build time, e.g. -DHIDAMARI_HEIGHT=43 for a 10x40 board. */
+#ifndef HIDAMARI_HEIGHT
 #define HIDAMARI_HEIGHT 23
+#endif
+#ifndef HIDAMARI_WIDTH
 #define HIDAMARI_WIDTH 12
+#endif
+
+/* Each row of the grid is a single word with a bit per column, so the
+ * narrowest word the board fits in is used */
+#if HIDAMARI_WIDTH <= 16
+typedef uint16_t HidamariRow;
+#elif HIDAMARI_WIDTH <= 32
+typedef uint32_t HidamariRow;
+#elif HIDAMARI_WIDTH <= 64
+typedef uint64_t HidamariRow;
+#else
+#error "HIDAMARI_WIDTH must be at most 64"
+#endif
+
+/* Masks of a whole row, of its walls, and of the columns between them */
+#define HIDAMARI_ROW_FULL ((HidamariRow)(((HidamariRow)2 << (HIDAMARI_WIDTH - 1)) - 1))
+#define HIDAMARI_ROW_WALLS ((HidamariRow)(1 | (HidamariRow)1 << (HIDAMARI_WIDTH - 1)))
+#define HIDAMARI_ROW_INNER ((HidamariRow)(HIDAMARI_ROW_FULL ^ HIDAMARI_ROW_WALLS))
 
 #define HIDAMARI_HEIGHT_VISIBLE (HIDAMARI_HEIGHT - 3)
 #define HIDAMARI_WIDTH_VISIBLE (HIDAMARI_WIDTH)
 
 #define HIDAMARI_BUFFER_HEIGHT (HIDAMARI_HEIGHT_VISIBLE + 3 + 3)
-#define HIDAMARI_BUFFER_WIDTH HIDAMARI_WIDTH * 2
+#define HIDAMARI_BUFFER_WIDTH (HIDAMARI_WIDTH * 2)
 
 /* Cursor index */
 #define HIDAMARI_MAIN_CURSOR 0
@@ -25,6 +48,12 @@
 
 #define ASCII_OFFSET (HIDAMARI_TILE_CHAR_A+1)
 
+/* Longest plan of inputs the AI can hold for a single hidamari */
+#define HIDAMARI_PLAN_MAX 64
+
+/* Highest level the score can reach */
+#define HIDAMARI_LEVEL_MAX 8
+
 typedef uint8_t Button;
 typedef uint8_t HidamariTile;
 typedef uint8_t HidamariShape;
@@ -33,6 +62,10 @@ typedef struct Hidamari Hidamari;
 typedef struct HidamariGame HidamariGame;
 typedef struct HidamariPlayField HidamariPlayField;
 typedef struct HidamariAIState HidamariAIState;
+typedef struct HidamariGameStats HidamariGameStats;
+typedef struct HidamariAIConfig HidamariAIConfig;
+typedef struct HidamariBook HidamariBook;
+typedef struct HidamariMLP HidamariMLP;
 typedef struct HidamariBuffer HidamariBuffer;
 typedef struct HidamariMenu HidamariMenu;
 
@@ -144,6 +177,40 @@ enum {
 	HIDAMARI_AI_LAST,
 };
 
+/* Board features weighed by the AI, in weight vector order */
+enum {
+	HIDAMARI_FEATURE_BUMPINESS, /* Height difference between columns */
+	HIDAMARI_FEATURE_HEIGHT, /* Aggregate height of all columns */
+	HIDAMARI_FEATURE_HOLES, /* Open cells with a filled cell above */
+	HIDAMARI_FEATURE_WELLS, /* Cumulative depth of one-wide wells */
+	HIDAMARI_FEATURE_ROW_TRANSITIONS, /* Filled/open changes along rows */
+	HIDAMARI_FEATURE_COL_TRANSITIONS, /* Filled/open changes along columns */
+	HIDAMARI_FEATURE_ERODED, /* Lines cleared times cells of the piece cleared */
+	HIDAMARI_FEATURE_LANDING_HEIGHT, /* Height the last piece locked at */
+	HIDAMARI_FEATURE_LAST,
+};
+
+struct HidamariAIConfig {
+	/* Only the first n_weight features are weighed; the placement
+	 * features are skipped when unused */
+	size_t n_weight;
+	double weight[HIDAMARI_FEATURE_LAST];
+	/* Monte Carlo evaluation of the best leaves of the search, see
+	 * rollout.h. The static evaluation alone is used if n_playout is 0. */
+	u32 n_playout; /* Playouts per decision */
+	u32 playout_depth; /* Hidamaries placed by each playout */
+	u32 n_thread; /* Threads running playouts, 0 for one per CPU */
+	/* Placements to play without searching, made with these weights by
+	 * hidamari-book, or NULL. See book.h. */
+	HidamariBook const *book;
+	/* Scores the leaves of the search in place of the weights, or NULL.
+	 * See mlp.h. */
+	HidamariMLP const *mlp;
+	/* Hidamaries to look ahead for a perfect clear, played without
+	 * searching when there is one, or 0 not to. See pc.h. */
+	u32 pc_pieces;
+};
+
 struct HidamariBuffer {
 	HidamariTile tile[HIDAMARI_BUFFER_WIDTH][HIDAMARI_BUFFER_HEIGHT];
 	u8 color[HIDAMARI_BUFFER_WIDTH][HIDAMARI_BUFFER_HEIGHT][3];
@@ -161,37 +228,59 @@ struct HidamariPlayField {
 	u8 level;
 	u32 score;
 	u32 lines;
+	u32 pieces; /* Hidamaries locked so far */
 	/* Timing */
 	f32 gravity_timer;
 	u8 slide_timer : 4;
 	/* Randomization */
+	u32 rng; /* State of the generator shuffling the bag */
 	u4 bag_pos : 4; /* Current position in the bag */
 	HidamariShape bag[7]; /* Random Bag, used for pseudo-random order */
 	/* Hidamaries */
 	HidamariShape next : 4; /* Lookahead piece for player */
 	Hidamari current;
-	u12 grid[HIDAMARI_HEIGHT]; /* Represents static Hidamaries */
+	HidamariRow grid[HIDAMARI_HEIGHT]; /* Represents static Hidamaries */
 };
 
 struct HidamariAIState {
 	bool active;
-	void *region;
-	Button const *planstr;
+	Button plan[HIDAMARI_PLAN_MAX]; /* BUTTON_NONE terminated */
+	uint8_t plan_pos; /* Next input of the plan to perform */
 	uint8_t skill;
+	HidamariAIConfig const *config; /* Overrides the skill preset if set */
+};
+
+/* Statistics of the game being played, reset when it starts */
+struct HidamariGameStats {
+	u32 seed; /* The game was started with */
+	u32 ticks; /* Timesteps played */
+	u32 clears[4]; /* Clears of one to four lines at once */
+	/* Hidamaries placed when each level from 1 up was reached, 0 if it
+	 * was not */
+	u32 level_pieces[HIDAMARI_LEVEL_MAX];
+	u32 plans; /* Plans made by the AI */
+	u64 plan_ns; /* Time spent on them */
 };
 
 struct HidamariGame {
 	HidamariGameState state;
-	HidamariBuffer buf;
+	HidamariBuffer *buf; /* Not drawn to if NULL */
 	uint8_t cursor[2];
 	HidamariPlayField field;
 	HidamariAIState ai;
+	u32 piece_ticks; /* Timesteps the current hidamari has been in play */
+	HidamariGameStats stats;
 };
 
-/* Initialize the playfield, and allocate the global region used by all
- * games. Also start the AI-thread. */
+/* Initialize the game at its main menu. Each update draws the game into
+ * _buf_, which may be NULL for a headless game that is never displayed. */
 void
-hidamari_init(HidamariGame *game);
+hidamari_init(HidamariGame *game, HidamariBuffer *buf);
+
+/* Return a game to its main menu with an empty playfield, keeping its
+ * buffer and AI settings, so that the same context can be used again. */
+void
+hidamari_reset(HidamariGame *game);
 
 /* Update the playfield by one timestep:
  *	Perform the player action;
@@ -204,10 +293,49 @@ hidamari_init(HidamariGame *game);
 void
 hidamari_update(HidamariGame *game, Button act);
 
+/* Update the game by one timestep like hidamari_update(), performing each
+ * of the _n_act_ actions in order first. A hard drop locks its hidamari
+ * right away, so the actions after it apply to the next one.
+ */
+void
+hidamari_update_inputs(HidamariGame *game, Button const *act, size_t n_act);
+
+/* Run up to _n_ timesteps, performing _act_[i] in the _i_th, and draw the
+ * game only once at the end. _act_ may be NULL to perform no action, as
+ * when the AI is playing. The run stops early after a timestep that changes
+ * the state of the game, such as a game ending.
+ *
+ * Return: The number of timesteps run.
+ */
+size_t
+hidamari_run(HidamariGame *game, Button const *act, size_t n);
+
+/* Start a new game right away, skipping the menu. The same _seed_ always
+ * produces the same sequence of hidamaries. Any game can be started again
+ * this way once it is over, without initializing it anew. */
+void
+hidamari_start(HidamariGame *game, u32 seed);
+
+/* The weights the AI of a game plays with: its own config if it has one,
+ * otherwise the preset of its skill level. */
+HidamariAIConfig const *
+hidamari_ai_config(HidamariGame const *game);
+
+/* Check if the AI has run out of planned inputs for the current hidamari */
+bool
+hidamari_needs_plan(HidamariGame const *game);
+
+/* Plan the inputs for the current hidamari with the given weights, using
+ * _region_ as scratch memory. The plan is copied into the game, so the
+ * region may be reused as soon as this returns. When a game plans for itself
+ * it borrows a region from the pool in region.h. */
+void
+hidamari_plan(HidamariGame *game, void *region, HidamariAIConfig const *config);
+
 /* An alternative update function with no visuals for particle-swarm
  * optimization, or simulation without the overhead of visualization.
  * The weights of the AI heuristics can be provided. */
 void
-hidamari_pso_update(HidamariGame *game, double weight[3]);
+hidamari_pso_update(HidamariGame *game, HidamariAIConfig const *config);
 
 #endif
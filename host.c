@@ -0,0 +1,199 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "hidamari.h"
+#include "host.h"
+#include "region.h"
+
+struct HidamariHost {
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* Signalled when tasks are queued */
+	pthread_cond_t done; /* Signalled when the last task finishes */
+	bool terminate;
+	size_t n_worker;
+	pthread_t *worker;
+	size_t n_game;
+	u32 max_lines;
+	HidamariGame *game;
+	size_t *ticks; /* Timesteps each game has left in the current step */
+	/* Ring of games waiting for a worker to plan for them */
+	size_t *queue;
+	size_t head;
+	size_t len;
+	size_t busy; /* Tasks queued or running */
+};
+
+/* Whether a game is to be advanced */
+static bool
+playing(HidamariHost const *host, HidamariGame const *game)
+{
+	return HIDAMARI_GS_GAME_PLAYING == game->state
+		&& (0 == host->max_lines || game->field.lines < host->max_lines);
+}
+
+/* Queue a game for the workers. The lock must be held. */
+static void
+push(HidamariHost *host, size_t i)
+{
+	host->queue[(host->head + host->len) % host->n_game] = i;
+	host->len += 1;
+	pthread_cond_signal(&host->work);
+}
+
+/* Plan for a game and advance it until it needs another plan or its
+ * timesteps run out.
+ *
+ * Return: true if the game needs to be queued again for its next plan.
+ */
+static bool
+advance(HidamariHost *host, size_t i, void *region)
+{
+	bool planned = false;
+	HidamariGame *game = &host->game[i];
+
+	while (host->ticks[i] > 0 && playing(host, game)) {
+		if (game->ai.active && hidamari_needs_plan(game)) {
+			if (planned)
+				return true;
+			hidamari_plan(game, region, hidamari_ai_config(game));
+			planned = true;
+		}
+		hidamari_update(game, BUTTON_NONE);
+		host->ticks[i] -= 1;
+	}
+	return false;
+}
+
+static void *
+work(void *arg)
+{
+	size_t i;
+	bool again;
+	void *region;
+	HidamariHost *host = arg;
+
+	region = region_borrow(ai_size_requirement());
+	pthread_mutex_lock(&host->lock);
+	for (;;) {
+		while (!host->terminate && 0 == host->len)
+			pthread_cond_wait(&host->work, &host->lock);
+		if (host->terminate)
+			break;
+		i = host->queue[host->head];
+		host->head = (host->head + 1) % host->n_game;
+		host->len -= 1;
+		pthread_mutex_unlock(&host->lock);
+
+		again = advance(host, i, region);
+
+		pthread_mutex_lock(&host->lock);
+		if (again) {
+			push(host, i);
+		} else {
+			host->busy -= 1;
+			if (0 == host->busy)
+				pthread_cond_broadcast(&host->done);
+		}
+	}
+	pthread_mutex_unlock(&host->lock);
+	region_return(region);
+	return NULL;
+}
+
+HidamariHost *
+host_create(size_t n_worker, size_t n_game, u32 max_lines)
+{
+	size_t i;
+	HidamariHost *host;
+
+	if (0 == n_worker)
+		n_worker = sysconf(_SC_NPROCESSORS_ONLN);
+	host = calloc(1, sizeof(*host));
+	if (!host)
+		return NULL;
+	host->n_game = n_game;
+	host->max_lines = max_lines;
+	host->game = calloc(n_game, sizeof(*host->game));
+	host->ticks = calloc(n_game, sizeof(*host->ticks));
+	host->queue = calloc(n_game, sizeof(*host->queue));
+	host->worker = calloc(n_worker, sizeof(*host->worker));
+	if (!host->game || !host->ticks || !host->queue || !host->worker) {
+		host_destroy(host);
+		return NULL;
+	}
+	for (i = 0; i < n_game; ++i) {
+		hidamari_init(&host->game[i], NULL);
+		host->game[i].ai.active = true;
+	}
+	pthread_mutex_init(&host->lock, NULL);
+	pthread_cond_init(&host->work, NULL);
+	pthread_cond_init(&host->done, NULL);
+	for (i = 0; i < n_worker; ++i) {
+		if (0 != pthread_create(&host->worker[i], NULL, work, host))
+			break;
+		host->n_worker += 1;
+	}
+	if (0 == host->n_worker) {
+		host_destroy(host);
+		return NULL;
+	}
+	return host;
+}
+
+void
+host_destroy(HidamariHost *host)
+{
+	size_t i;
+
+	if (host->n_worker > 0) {
+		pthread_mutex_lock(&host->lock);
+		host->terminate = true;
+		pthread_cond_broadcast(&host->work);
+		pthread_mutex_unlock(&host->lock);
+		for (i = 0; i < host->n_worker; ++i) {
+			pthread_join(host->worker[i], NULL);
+		}
+		pthread_mutex_destroy(&host->lock);
+		pthread_cond_destroy(&host->work);
+		pthread_cond_destroy(&host->done);
+	}
+	free(host->worker);
+	free(host->queue);
+	free(host->ticks);
+	free(host->game);
+	free(host);
+}
+
+HidamariGame *
+host_game(HidamariHost *host, size_t i)
+{
+	return &host->game[i];
+}
+
+size_t
+host_step(HidamariHost *host, size_t n_tick)
+{
+	size_t i;
+	size_t n_playing = 0;
+
+	pthread_mutex_lock(&host->lock);
+	for (i = 0; i < host->n_game; ++i) {
+		if (!playing(host, &host->game[i]))
+			continue;
+		host->ticks[i] = n_tick;
+		host->busy += 1;
+		push(host, i);
+	}
+	while (host->busy > 0)
+		pthread_cond_wait(&host->done, &host->lock);
+	pthread_mutex_unlock(&host->lock);
+	for (i = 0; i < host->n_game; ++i) {
+		if (playing(host, &host->game[i]))
+			n_playing += 1;
+	}
+	return n_playing;
+}
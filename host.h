@@ -0,0 +1,45 @@
+/* See LICENSE file for copyright and license details */
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+typedef struct HidamariHost HidamariHost;
+
+/* Create a host for _n_game_ headless AI games, played by a fixed pool of
+ * _n_worker_ threads, or one per CPU if 0. Only the workers hold AI
+ * regions, so the memory for planning does not grow with the number of
+ * games. A game is no longer advanced once it has cleared _max_lines_
+ * lines, unless that is 0.
+ *
+ * Each game starts at the main menu with the AI enabled. Use host_game() and
+ * hidamari_start() to begin playing it, and set its skill or config as
+ * needed before the next host_step().
+ *
+ * Return: The new host, or NULL if it could not be created.
+ */
+HidamariHost *
+host_create(size_t n_worker, size_t n_game, u32 max_lines);
+
+/* Stop the workers and free the host along with all of its games */
+void
+host_destroy(HidamariHost *host);
+
+/* Get the _i_th game of the host */
+HidamariGame *
+host_game(HidamariHost *host, size_t i);
+
+/* Advance every game that is playing, and has lines left to clear, by up
+ * to _n_tick_ timesteps. Each time
+ * a game runs out of planned inputs, a planning task is queued for it, and
+ * the workers take the queued tasks in turn until every game has been
+ * advanced.
+ *
+ * Return: The number of games still to be advanced.
+ */
+size_t
+host_step(HidamariHost *host, size_t n_tick);
+
+#endif
@@ -0,0 +1,161 @@
+/* See LICENSE file for copyright and license details */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+#include "input.h"
+#include "telemetry.h"
+
+void
+input_ring_init(InputRing *ring)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+bool
+input_push(InputRing *ring, u64 time, Button button, bool down)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (INPUT_RING_SIZE == tail - head) {
+		telemetry_count(TELEMETRY_INPUTS_DROPPED, 1);
+		return false;
+	}
+	ring->event[tail & (INPUT_RING_SIZE - 1)] = (InputEvent){
+		.time = time,
+		.button = button,
+		.down = down,
+	};
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+void
+input_init(InputState *state, u64 das, u64 arr, u64 sdr)
+{
+	size_t i;
+
+	state->das = das;
+	state->arr = arr;
+	state->sdr = sdr;
+	for (i = 0; i < BUTTON_LAST; ++i) {
+		state->held[i] = false;
+	}
+	state->shift.button = BUTTON_NONE;
+	state->drop.button = BUTTON_NONE;
+}
+
+/* Append an action to the timestep, unless it is already full */
+static void
+emit(Button button, Button *act, size_t *n, size_t max)
+{
+	if (*n < max) {
+		act[(*n)++] = button;
+	} else {
+		telemetry_count(TELEMETRY_INPUTS_DROPPED, 1);
+	}
+}
+
+/* Perform every repeat due by _t_, in order of time. A repeat with no
+ * period moves as far as the board allows, then waits for the next
+ * timestep, which ends after _end_. */
+static void
+repeat_until(InputState *state, u64 t, u64 end, Button *act, size_t *n,
+		size_t max)
+{
+	size_t i, burst;
+	u64 period;
+	InputRepeat *r;
+
+	for (;;) {
+		r = NULL;
+		if (BUTTON_NONE != state->shift.button && state->shift.next <= t)
+			r = &state->shift;
+		if (BUTTON_NONE != state->drop.button && state->drop.next <= t
+		    && (!r || state->drop.next < r->next))
+			r = &state->drop;
+		if (!r)
+			return;
+		period = r == &state->shift ? state->arr : state->sdr;
+		burst = r == &state->shift ? HIDAMARI_WIDTH : HIDAMARI_HEIGHT;
+		if (0 == period) {
+			for (i = 0; i < burst; ++i) {
+				emit(r->button, act, n, max);
+			}
+			r->next = end + 1;
+		} else if (*n < max) {
+			emit(r->button, act, n, max);
+			r->next += period;
+		} else {
+			/* Skip the repeats there is no room for */
+			telemetry_count(TELEMETRY_INPUTS_DROPPED,
+					(t - r->next) / period + 1);
+			r->next += ((t - r->next) / period + 1) * period;
+		}
+	}
+}
+
+/* Apply a press or release to the held buttons and their repeats */
+static void
+apply(InputState *state, InputEvent const *e, Button *act, size_t *n,
+		size_t max)
+{
+	Button other;
+
+	state->held[e->button] = e->down;
+	switch (e->button) {
+	case BUTTON_LEFT:
+	case BUTTON_RIGHT:
+		if (e->down) {
+			emit(e->button, act, n, max);
+			state->shift.button = e->button;
+			state->shift.next = e->time + state->das;
+		} else if (e->button == state->shift.button) {
+			/* Fall back to the other direction if it is still
+			 * held, charging its delay anew */
+			other = BUTTON_LEFT == e->button ? BUTTON_RIGHT : BUTTON_LEFT;
+			state->shift.button = state->held[other] ? other : BUTTON_NONE;
+			state->shift.next = e->time + state->das;
+		}
+		break;
+	case BUTTON_DOWN:
+		if (e->down) {
+			emit(e->button, act, n, max);
+			state->drop.button = BUTTON_DOWN;
+			state->drop.next = e->time + state->sdr;
+		} else {
+			state->drop.button = BUTTON_NONE;
+		}
+		break;
+	default:
+		if (e->down)
+			emit(e->button, act, n, max);
+		break;
+	}
+}
+
+size_t
+input_tick(InputState *state, InputRing *ring, u64 end, Button *act,
+		size_t max)
+{
+	size_t n = 0;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	InputEvent e;
+
+	for (; head != tail; ++head) {
+		e = ring->event[head & (INPUT_RING_SIZE - 1)];
+		if (e.time > end)
+			break;
+		if (e.button >= BUTTON_LAST)
+			continue;
+		repeat_until(state, e.time, end, act, &n, max);
+		apply(state, &e, act, &n, max);
+	}
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+	repeat_until(state, end, end, act, &n, max);
+	return n;
+}
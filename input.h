@@ -0,0 +1,84 @@
+/* See LICENSE file for copyright and license details */
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* Timestamped button presses and releases travel from the thread polling
+ * for them to the one running the game through a lock-free ring. At each
+ * timestep the game takes every event up to the end of that timestep, in
+ * order, along with the auto-repeats of held buttons falling within it.
+ *
+ * Times are in nanoseconds of any clock shared by both sides, so events
+ * and repeats keep their order within a timestep. */
+
+/* Capacity of the ring, must be a power of two */
+#define INPUT_RING_SIZE 256
+
+/* Most actions performed in a single timestep */
+#define INPUT_TICK_MAX 32
+
+typedef struct {
+	u64 time;
+	Button button;
+	bool down; /* Pressed if true, released otherwise */
+} InputEvent;
+
+/* Single producer, single consumer queue of input events */
+typedef struct {
+	_Atomic size_t head; /* Next event to take, written by the consumer */
+	_Atomic size_t tail; /* Next free slot, written by the producer */
+	InputEvent event[INPUT_RING_SIZE];
+} InputRing;
+
+/* A button that repeats while it is held */
+typedef struct {
+	Button button; /* BUTTON_NONE while not repeating */
+	u64 next; /* Time of the next repeat */
+} InputRepeat;
+
+typedef struct {
+	/* Delayed auto-shift: time left or right must be held before it
+	 * starts repeating */
+	u64 das;
+	/* Auto-repeat rate: time between repeats of left or right once they
+	 * have started, 0 to shift all the way at once */
+	u64 arr;
+	/* Time between repeats of a held soft drop, 0 to drop all the way at
+	 * once */
+	u64 sdr;
+	bool held[BUTTON_LAST];
+	InputRepeat shift; /* Left or right, whichever was pressed last */
+	InputRepeat drop;
+} InputState;
+
+/* Empty the ring. Neither side may use it meanwhile. */
+void
+input_ring_init(InputRing *ring);
+
+/* Queue an event. Only one thread may push to a ring.
+ *
+ * Return: false if the ring is full and the event was dropped.
+ */
+bool
+input_push(InputRing *ring, u64 time, Button button, bool down);
+
+/* Release every button and set the repeat timings, in nanoseconds */
+void
+input_init(InputState *state, u64 das, u64 arr, u64 sdr);
+
+/* Take the events up to _end_ from the ring and turn them, along with the
+ * repeats of held buttons due by then, into the actions of one timestep.
+ * Only one thread may take from a ring.
+ *
+ * Return: The number of actions written to _act_, at most _max_.
+ */
+size_t
+input_tick(InputState *state, InputRing *ring, u64 end, Button *act,
+		size_t max);
+
+#endif
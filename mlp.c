@@ -0,0 +1,332 @@
+/* See LICENSE file for copyright and license details */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "field.h"
+#include "hidamari.h"
+#include "mlp.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(HIDAMARI_NO_AVX2)
+#define MLP_AVX2
+#include <immintrin.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Outputs of the first layer summed at once, kept in registers */
+#define BLOCK 32
+/* Positions run through each layer together, so its weights are read
+ * from memory once for all of them */
+#define BATCH 16
+/* Bound of the biases of the second and third layers, leaving room for
+ * the largest sums of products below INT32_MAX */
+#define BIAS_MAX (1 << 30)
+
+/* The first layer sums a bias, the weights of the filled cells and each
+ * feature times its weight, all within INT16_MAX in magnitude but for the
+ * features, which are held to MLP_FEATURE_MAX */
+_Static_assert((1 + MLP_CELLS + (long long)HIDAMARI_FEATURE_LAST
+		* MLP_FEATURE_MAX) * 32768 <= INT32_MAX,
+		"the first layer of the model could overflow");
+_Static_assert(BIAS_MAX + (long long)MLP_HIDDEN1_MAX * 127 * 128
+		<= INT32_MAX, "the second layer of the model could overflow");
+
+struct HidamariMLP {
+	size_t n1;
+	size_t n2;
+	unsigned shift1;
+	unsigned shift2;
+	double out_scale;
+	int16_t *b1; /* [n1] */
+	int16_t *w1; /* [MLP_INPUTS][n1] */
+	int32_t *b2; /* [n2] */
+	int8_t *w2; /* [n2][n1] */
+	int32_t b3;
+	int8_t *w3; /* [n2] */
+	bool avx2;
+};
+
+/* The inputs of a position: the inner cells that are filled, and the
+ * quantised features */
+typedef struct {
+	size_t n_cell;
+	u16 cell[MLP_CELLS];
+	int32_t feature[HIDAMARI_FEATURE_LAST];
+} Input;
+
+static void
+gather(HidamariPlayField const *field, double const f[HIDAMARI_FEATURE_LAST],
+		Input *in)
+{
+	int x, y;
+	size_t i;
+	HidamariRow bits;
+
+	in->n_cell = 0;
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		for (bits = field->grid[y] & HIDAMARI_ROW_INNER; bits;
+		     bits &= bits - 1) {
+			x = row_ctz(bits);
+			in->cell[in->n_cell++] = (y - 1) * (HIDAMARI_WIDTH - 2) + x - 1;
+		}
+	}
+	for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+		in->feature[i] = lrint(MAX(-MLP_FEATURE_MAX, MIN(MLP_FEATURE_MAX,
+				f[i] * MLP_FEATURE_SCALE)));
+	}
+}
+
+static u8
+clip(int32_t v, unsigned shift)
+{
+	return MAX(0, MIN(127, v >> shift));
+}
+
+static void
+layer1(HidamariMLP const *mlp, Input const in[], size_t n,
+		u8 h1[][MLP_HIDDEN1_MAX])
+{
+	size_t i, j, k, p;
+	int16_t const *w;
+	int32_t acc[BLOCK];
+
+	for (j = 0; j < mlp->n1; j += BLOCK) {
+		for (p = 0; p < n; ++p) {
+			for (k = 0; k < BLOCK; ++k) {
+				acc[k] = mlp->b1[j + k];
+			}
+			for (i = 0; i < in[p].n_cell; ++i) {
+				w = &mlp->w1[in[p].cell[i] * mlp->n1 + j];
+				for (k = 0; k < BLOCK; ++k) {
+					acc[k] += w[k];
+				}
+			}
+			for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+				w = &mlp->w1[(MLP_CELLS + i) * mlp->n1 + j];
+				for (k = 0; k < BLOCK; ++k) {
+					acc[k] += in[p].feature[i] * w[k];
+				}
+			}
+			for (k = 0; k < BLOCK; ++k) {
+				h1[p][j + k] = clip(acc[k], mlp->shift1);
+			}
+		}
+	}
+}
+
+static void
+layer2(HidamariMLP const *mlp, u8 const h1[][MLP_HIDDEN1_MAX], size_t n,
+		u8 h2[][MLP_HIDDEN2_MAX])
+{
+	size_t i, j, p;
+	int32_t acc;
+	int8_t const *w;
+
+	for (j = 0; j < mlp->n2; ++j) {
+		w = &mlp->w2[j * mlp->n1];
+		for (p = 0; p < n; ++p) {
+			acc = mlp->b2[j];
+			for (i = 0; i < mlp->n1; ++i) {
+				acc += h1[p][i] * w[i];
+			}
+			h2[p][j] = clip(acc, mlp->shift2);
+		}
+	}
+}
+
+#ifdef MLP_AVX2
+__attribute__((target("avx2"))) static void
+layer1_avx2(HidamariMLP const *mlp, Input const in[], size_t n,
+		u8 h1[][MLP_HIDDEN1_MAX])
+{
+	size_t i, j, k, p;
+	int16_t const *w;
+	__m256i acc[BLOCK / 8], x;
+	__m256i zero = _mm256_setzero_si256(), top = _mm256_set1_epi32(127);
+	__m128i shift = _mm_cvtsi32_si128(mlp->shift1);
+	int32_t out[BLOCK];
+
+	for (j = 0; j < mlp->n1; j += BLOCK) {
+		for (p = 0; p < n; ++p) {
+			for (k = 0; k < BLOCK / 8; ++k) {
+				acc[k] = _mm256_cvtepi16_epi32(_mm_loadu_si128(
+						(__m128i const *)&mlp->b1[j + 8 * k]));
+			}
+			for (i = 0; i < in[p].n_cell; ++i) {
+				w = &mlp->w1[in[p].cell[i] * mlp->n1 + j];
+				for (k = 0; k < BLOCK / 8; ++k) {
+					acc[k] = _mm256_add_epi32(acc[k],
+							_mm256_cvtepi16_epi32(_mm_loadu_si128(
+							(__m128i const *)&w[8 * k])));
+				}
+			}
+			for (i = 0; i < HIDAMARI_FEATURE_LAST; ++i) {
+				w = &mlp->w1[(MLP_CELLS + i) * mlp->n1 + j];
+				x = _mm256_set1_epi32(in[p].feature[i]);
+				for (k = 0; k < BLOCK / 8; ++k) {
+					acc[k] = _mm256_add_epi32(acc[k],
+							_mm256_mullo_epi32(x,
+							_mm256_cvtepi16_epi32(_mm_loadu_si128(
+							(__m128i const *)&w[8 * k]))));
+				}
+			}
+			for (k = 0; k < BLOCK / 8; ++k) {
+				x = _mm256_sra_epi32(acc[k], shift);
+				x = _mm256_min_epi32(_mm256_max_epi32(x, zero), top);
+				_mm256_storeu_si256((__m256i *)&out[8 * k], x);
+			}
+			for (k = 0; k < BLOCK; ++k) {
+				h1[p][j + k] = out[k];
+			}
+		}
+	}
+}
+
+__attribute__((target("avx2"))) static void
+layer2_avx2(HidamariMLP const *mlp, u8 const h1[][MLP_HIDDEN1_MAX], size_t n,
+		u8 h2[][MLP_HIDDEN2_MAX])
+{
+	size_t i, j, p;
+	int32_t acc;
+	int8_t const *w;
+	__m256i sum, ones = _mm256_set1_epi16(1);
+	__m128i half;
+
+	for (j = 0; j < mlp->n2; ++j) {
+		w = &mlp->w2[j * mlp->n1];
+		for (p = 0; p < n; ++p) {
+			sum = _mm256_setzero_si256();
+			for (i = 0; i < mlp->n1; i += 32) {
+				/* Pairs of products of at most 127 by 128 fit
+				 * 16 bits */
+				sum = _mm256_add_epi32(sum, _mm256_madd_epi16(ones,
+						_mm256_maddubs_epi16(
+						_mm256_loadu_si256(
+						(__m256i const *)&h1[p][i]),
+						_mm256_loadu_si256(
+						(__m256i const *)&w[i]))));
+			}
+			half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+					_mm256_extracti128_si256(sum, 1));
+			half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+			half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+			acc = mlp->b2[j] + _mm_cvtsi128_si32(half);
+			h2[p][j] = clip(acc, mlp->shift2);
+		}
+	}
+}
+#endif
+
+void
+mlp_evaluate(HidamariMLP const *mlp, HidamariPlayField const *const field[],
+		double const (*f)[HIDAMARI_FEATURE_LAST], size_t n,
+		double score[])
+{
+	size_t i, j, p, m;
+	int32_t out;
+	Input in[BATCH];
+	u8 h1[BATCH][MLP_HIDDEN1_MAX], h2[BATCH][MLP_HIDDEN2_MAX];
+
+	for (i = 0; i < n; i += m) {
+		m = MIN(n - i, BATCH);
+		for (p = 0; p < m; ++p) {
+			gather(field[i + p], f[i + p], &in[p]);
+		}
+#ifdef MLP_AVX2
+		if (mlp->avx2) {
+			layer1_avx2(mlp, in, m, h1);
+			layer2_avx2(mlp, (u8 const (*)[MLP_HIDDEN1_MAX])h1, m, h2);
+		} else
+#endif
+		{
+			layer1(mlp, in, m, h1);
+			layer2(mlp, (u8 const (*)[MLP_HIDDEN1_MAX])h1, m, h2);
+		}
+		for (p = 0; p < m; ++p) {
+			out = mlp->b3;
+			for (j = 0; j < mlp->n2; ++j) {
+				out += h2[p][j] * mlp->w3[j];
+			}
+			score[i + p] = out * mlp->out_scale;
+		}
+	}
+}
+
+HidamariMLP *
+mlp_open(char const *path)
+{
+	bool ok;
+	size_t i;
+	FILE *fp;
+	MLPHeader header;
+	HidamariMLP *mlp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return NULL;
+	if (1 != fread(&header, sizeof(header), 1, fp)
+	    || 0 != memcmp(header.magic, MLP_MAGIC, sizeof(header.magic))
+	    || HIDAMARI_WIDTH != header.width
+	    || HIDAMARI_HEIGHT != header.height
+	    || 0 == header.n_hidden1 || 0 != header.n_hidden1 % 32
+	    || header.n_hidden1 > MLP_HIDDEN1_MAX
+	    || 0 == header.n_hidden2 || 0 != header.n_hidden2 % 32
+	    || header.n_hidden2 > MLP_HIDDEN2_MAX
+	    || header.shift1 > 31 || header.shift2 > 31) {
+		fclose(fp);
+		return NULL;
+	}
+	mlp = calloc(1, sizeof(*mlp));
+	if (!mlp) {
+		fclose(fp);
+		return NULL;
+	}
+	mlp->n1 = header.n_hidden1;
+	mlp->n2 = header.n_hidden2;
+	mlp->shift1 = header.shift1;
+	mlp->shift2 = header.shift2;
+	mlp->out_scale = header.out_scale;
+	mlp->b1 = malloc(mlp->n1 * sizeof(*mlp->b1));
+	mlp->w1 = malloc(MLP_INPUTS * mlp->n1 * sizeof(*mlp->w1));
+	mlp->b2 = malloc(mlp->n2 * sizeof(*mlp->b2));
+	mlp->w2 = malloc(mlp->n2 * mlp->n1 * sizeof(*mlp->w2));
+	mlp->w3 = malloc(mlp->n2 * sizeof(*mlp->w3));
+	ok = mlp->b1 && mlp->w1 && mlp->b2 && mlp->w2 && mlp->w3
+		&& mlp->n1 == fread(mlp->b1, sizeof(*mlp->b1), mlp->n1, fp)
+		&& MLP_INPUTS * mlp->n1
+			== fread(mlp->w1, sizeof(*mlp->w1), MLP_INPUTS * mlp->n1, fp)
+		&& mlp->n2 == fread(mlp->b2, sizeof(*mlp->b2), mlp->n2, fp)
+		&& mlp->n2 * mlp->n1
+			== fread(mlp->w2, sizeof(*mlp->w2), mlp->n2 * mlp->n1, fp)
+		&& 1 == fread(&mlp->b3, sizeof(mlp->b3), 1, fp)
+		&& mlp->n2 == fread(mlp->w3, sizeof(*mlp->w3), mlp->n2, fp);
+	fclose(fp);
+	if (!ok) {
+		mlp_close(mlp);
+		return NULL;
+	}
+	for (i = 0; i < mlp->n2; ++i) {
+		mlp->b2[i] = MAX(-BIAS_MAX, MIN(BIAS_MAX, mlp->b2[i]));
+	}
+	mlp->b3 = MAX(-BIAS_MAX, MIN(BIAS_MAX, mlp->b3));
+#ifdef MLP_AVX2
+	mlp->avx2 = __builtin_cpu_supports("avx2");
+#endif
+	return mlp;
+}
+
+void
+mlp_close(HidamariMLP *mlp)
+{
+	free(mlp->b1);
+	free(mlp->w1);
+	free(mlp->b2);
+	free(mlp->w2);
+	free(mlp->w3);
+	free(mlp);
+}
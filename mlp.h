@@ -0,0 +1,73 @@
+/* See LICENSE file for copyright and license details */
+#ifndef MLP_H
+#define MLP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* A small quantised multilayer perceptron that scores positions in place of
+ * the weighted features, lower being better as with the weights.
+ *
+ * Its inputs are the inner cells of the grid, one per bit, row by row from
+ * the bottom, followed by the board features of ai_features(), each times
+ * MLP_FEATURE_SCALE and rounded. Two hidden layers with clipped ReLUs feed
+ * a single output:
+ *
+ *	h1 = clamp((b1 + W1 x) >> shift1, 0, 127)
+ *	h2 = clamp((b2 + W2 h1) >> shift2, 0, 127)
+ *	score = (b3 + w3 h2) * out_scale
+ *
+ * The features are held to MLP_FEATURE_MAX after scaling, and b2 and b3
+ * to 2^30 in magnitude when loaded, so all sums are exact in 32 bits and
+ * the AVX2 kernels, used when the CPU has them and HIDAMARI_NO_AVX2 is not
+ * defined, give the same scores as the portable ones. Positions are scored
+ * in batches, each layer taking all of a batch before the next.
+ *
+ * A model file is an MLPHeader followed by b1 and W1 as i16, W1 stored
+ * input by input, then b2 as i32, W2 as i8 stored output by output, b3 as
+ * i32 and w3 as i8, in the byte order of the machine that reads it. */
+
+#define MLP_MAGIC "HDMMLP01"
+
+#define MLP_CELLS ((HIDAMARI_WIDTH - 2) * (HIDAMARI_HEIGHT - 1))
+#define MLP_INPUTS (MLP_CELLS + HIDAMARI_FEATURE_LAST)
+#define MLP_FEATURE_SCALE 2
+#define MLP_FEATURE_MAX 4095
+
+/* The hidden layers must be multiples of 32 up to these */
+#define MLP_HIDDEN1_MAX 512
+#define MLP_HIDDEN2_MAX 128
+
+typedef struct {
+	char magic[8];
+	u32 width; /* Board the model was trained for */
+	u32 height;
+	u32 n_hidden1;
+	u32 n_hidden2;
+	u32 shift1;
+	u32 shift2;
+	f32 out_scale;
+	u32 reserved;
+} MLPHeader;
+
+/* Load a model file.
+ *
+ * Return: The model, or NULL if the file cannot be read or does not fit
+ *	this board.
+ */
+HidamariMLP *
+mlp_open(char const *path);
+
+void
+mlp_close(HidamariMLP *mlp);
+
+/* Score _n_ positions, each a grid and its features as computed by
+ * ai_features() */
+void
+mlp_evaluate(HidamariMLP const *mlp, HidamariPlayField const *const field[],
+		double const (*f)[HIDAMARI_FEATURE_LAST], size_t n,
+		double score[]);
+
+#endif
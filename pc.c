@@ -0,0 +1,300 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai.h"
+#include "field.h"
+#include "hidamari.h"
+#include "pc.h"
+#include "vector.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define INNER_WIDTH (HIDAMARI_WIDTH - 2)
+
+/* A board being cleared: its lowest _h_ rows, inner cells only */
+typedef struct {
+	HidamariRow row[PC_ROWS_MAX];
+	u8 h;
+} Board;
+
+/* A distinct orientation of a shape, as rows of cells from its lowest one,
+ * with its leftmost column at bit 0 */
+typedef struct {
+	HidamariRow mask[4];
+	int width;
+	int height;
+	u8 orientation;
+	int dx; /* Column of the leftmost cell relative to the position */
+	int dy; /* Row of the lowest cell relative to the position */
+	int bottom[4]; /* Row of the lowest cell of each of its columns */
+} Form;
+
+static u64
+board_hash(Board b)
+{
+	int i;
+	u64 h = b.h;
+
+	for (i = 0; i < b.h; ++i) {
+		h = (h ^ b.row[i]) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+static bool
+board_equal(Board a, Board b)
+{
+	return a.h == b.h && 0 == memcmp(a.row, b.row, a.h * sizeof(*a.row));
+}
+
+/* Boards that cannot be cleared by the rest of the queue. For a given
+ * number of rows to clear, the rest of the queue follows from the board,
+ * since every hidamari fills 4 cells, so the set is emptied for each. */
+HASHMAP_INSTANTIATE(BoardSet, Board, bool, board_hash, board_equal, vec_heap)
+
+typedef struct {
+	Form form[HIDAMARI_LAST][4];
+	size_t n_form[HIDAMARI_LAST];
+	HidamariShape queue[PC_PIECES_MAX];
+	size_t n_piece;
+	BoardSet failed;
+	u64 nodes;
+	Hidamari placed[PC_PIECES_MAX];
+} Solver;
+
+static void
+make_forms(Solver *s)
+{
+	int i, j, minx, miny;
+	HidamariShape shape;
+	u8 o;
+	Vec2 cell[4];
+	Hidamari t = {0};
+	Form f, *prev;
+
+	for (shape = 0; shape < HIDAMARI_LAST; ++shape) {
+		s->n_form[shape] = 0;
+		for (o = 0; o < 4; ++o) {
+			t.shape = shape;
+			t.orientation = o;
+			field_cells(&t, cell);
+			minx = miny = INT8_MAX;
+			for (i = 0; i < 4; ++i) {
+				minx = MIN(minx, cell[i].x);
+				miny = MIN(miny, cell[i].y);
+			}
+			memset(&f, 0, sizeof(f));
+			for (i = 0; i < 4; ++i) {
+				f.bottom[i] = 4;
+			}
+			for (i = 0; i < 4; ++i) {
+				f.mask[cell[i].y - miny] |=
+					(HidamariRow)1 << (cell[i].x - minx);
+				f.width = MAX(f.width, cell[i].x - minx + 1);
+				f.height = MAX(f.height, cell[i].y - miny + 1);
+				f.bottom[cell[i].x - minx] = MIN(
+						f.bottom[cell[i].x - minx],
+						cell[i].y - miny);
+			}
+			f.orientation = o;
+			f.dx = minx;
+			f.dy = miny;
+			/* Orientations covering the same cells drop alike */
+			for (j = 0; j < (int)s->n_form[shape]; ++j) {
+				prev = &s->form[shape][j];
+				if (0 == memcmp(prev->mask, f.mask, sizeof(f.mask)))
+					break;
+			}
+			if (j == (int)s->n_form[shape])
+				s->form[shape][s->n_form[shape]++] = f;
+		}
+	}
+}
+
+/* Whether every stretch of the board walled off by a filled column has a
+ * multiple of 4 empty cells. Filled columns stay filled as rows clear. */
+static bool
+splits(Board const *b)
+{
+	int y, x, empty;
+	HidamariRow full = HIDAMARI_ROW_INNER, left, bits;
+
+	for (y = 0; y < b->h; ++y) {
+		full &= b->row[y];
+	}
+	for (bits = full; bits; bits &= bits - 1) {
+		x = row_ctz(bits);
+		left = HIDAMARI_ROW_INNER & (((HidamariRow)1 << x) - 1);
+		empty = 0;
+		for (y = 0; y < b->h; ++y) {
+			empty += row_popcount(left & ~b->row[y]);
+		}
+		if (0 != empty % 4)
+			return false;
+	}
+	return true;
+}
+
+/* Whether the board has an empty cell under a filled one. Straight drops
+ * cannot reach it until every row above it clears, which is rare enough
+ * not to search for. */
+static bool
+covered(Board const *b)
+{
+	int y;
+	HidamariRow above = 0;
+
+	for (y = b->h - 1; y >= 0; --y) {
+		if (above & ~b->row[y])
+			return true;
+		above |= b->row[y];
+	}
+	return false;
+}
+
+/* Drop _f_ in column _x_ of the board, given the row above the highest
+ * filled cell of every column, and clear the rows it fills.
+ *
+ * Return: The row its lowest cell landed in, or -1 if it sticks out
+ *	above the board or covers an empty cell.
+ */
+static int
+drop(Board const *b, int const top[HIDAMARI_WIDTH], Form const *f, int x,
+		Board *out)
+{
+	int i, r, y = 0, n;
+	HidamariRow row;
+
+	for (i = 0; i < f->width; ++i) {
+		y = MAX(y, top[x + i] - f->bottom[i]);
+	}
+	if (y + f->height > b->h)
+		return -1;
+	n = 0;
+	for (r = 0; r < b->h; ++r) {
+		row = b->row[r];
+		if (r >= y && r < y + f->height)
+			row |= f->mask[r - y] << x;
+		if (HIDAMARI_ROW_INNER != row)
+			out->row[n++] = row;
+	}
+	out->h = n;
+	for (; n < PC_ROWS_MAX; ++n) {
+		out->row[n] = 0;
+	}
+	return covered(out) ? -1 : y;
+}
+
+/* Return: 1 if the board can be cleared with the queue from _depth_ on, 0
+ *	if not, or -1 if the search has to give up */
+static int
+solve(Solver *s, Board const *b, size_t depth)
+{
+	int x, y, ret, top[HIDAMARI_WIDTH] = {0};
+	size_t i;
+	bool added;
+	bool *seen;
+	HidamariRow bits;
+	Form const *f;
+	Board next;
+
+	if (0 == b->h)
+		return 1;
+	if (depth == s->n_piece || !splits(b))
+		return 0;
+	if (BoardSet_find(&s->failed, *b))
+		return 0;
+	if (++s->nodes > PC_NODES_MAX)
+		return -1;
+	for (y = 0; y < b->h; ++y) {
+		for (bits = b->row[y]; bits; bits &= bits - 1) {
+			top[row_ctz(bits)] = y + 1;
+		}
+	}
+	for (i = 0; i < s->n_form[s->queue[depth]]; ++i) {
+		f = &s->form[s->queue[depth]][i];
+		for (x = 1; x + f->width <= HIDAMARI_WIDTH - 1; ++x) {
+			y = drop(b, top, f, x, &next);
+			if (0 > y)
+				continue;
+			s->placed[depth].shape = s->queue[depth];
+			s->placed[depth].orientation = f->orientation;
+			s->placed[depth].pos.x = x - f->dx;
+			/* Board row 0 is the row above the floor */
+			s->placed[depth].pos.y = 1 + y - f->dy;
+			ret = solve(s, &next, depth + 1);
+			if (0 != ret)
+				return ret;
+		}
+	}
+	seen = BoardSet_get(&s->failed, *b, &added);
+	if (!seen)
+		return -1;
+	*seen = true;
+	return 0;
+}
+
+int
+pc_solve(HidamariPlayField const *field, size_t max_pieces, PCSolution *sol)
+{
+	int y, h, top = 0, filled, empty, ret = 0;
+	size_t i;
+	Board b;
+	Solver *s;
+
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		if (field->grid[y] & HIDAMARI_ROW_INNER)
+			top = y;
+	}
+	if (top > PC_ROWS_MAX)
+		return 0;
+	s = malloc(sizeof(*s));
+	if (!s)
+		return -1;
+	make_forms(s);
+	s->nodes = 0;
+	max_pieces = MIN(max_pieces, PC_PIECES_MAX);
+	field_preview(field, s->queue, max_pieces);
+	/* Every hidamari fills 4 cells, so the rows to clear decide how many
+	 * hidamaries it takes */
+	for (h = MAX(top, 1); h <= PC_ROWS_MAX && 0 == ret; ++h) {
+		memset(&b, 0, sizeof(b));
+		b.h = h;
+		filled = 0;
+		for (y = 0; y < h; ++y) {
+			b.row[y] = field->grid[y + 1] & HIDAMARI_ROW_INNER;
+			filled += row_popcount(b.row[y]);
+		}
+		empty = h * INNER_WIDTH - filled;
+		if (0 != empty % 4 || (size_t)empty / 4 > max_pieces
+				|| covered(&b))
+			continue;
+		s->n_piece = empty / 4;
+		BoardSet_init(&s->failed, NULL);
+		ret = solve(s, &b, 0);
+		BoardSet_free(&s->failed);
+	}
+	if (1 == ret) {
+		sol->n = s->n_piece;
+		for (i = 0; i < s->n_piece; ++i) {
+			sol->placed[i] = s->placed[i];
+		}
+	}
+	free(s);
+	return ret;
+}
+
+Button const *
+pc_plan(void *region, HidamariPlayField const *field, size_t max_pieces)
+{
+	PCSolution sol;
+
+	if (1 != pc_solve(field, max_pieces, &sol))
+		return NULL;
+	return ai_path(region, field, &sol.placed[0]);
+}
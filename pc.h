@@ -0,0 +1,53 @@
+/* See LICENSE file for copyright and license details */
+#ifndef PC_H
+#define PC_H
+
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* A perfect clear solver. It looks for placements of the coming hidamaries,
+ * in the order they will come, that fill the lowest few rows of the board
+ * exactly so that every cell is cleared. The queue is the current and next
+ * hidamari followed by the bag, see field_preview().
+ *
+ * Only hidamaries dropped straight down are considered, and none may stick
+ * out above the rows being cleared. The search is depth first on the rows
+ * as bitboards. It skips boards whose empty cells cannot be split into
+ * whole hidamaries, because a filled column walls off a count of cells
+ * that is not a multiple of 4, and boards with an empty cell under a
+ * filled one, though the rows above it might yet clear. It remembers every
+ * board it has already failed to clear. */
+
+/* Rows a perfect clear may take up */
+#define PC_ROWS_MAX 4
+#define PC_PIECES_MAX 16
+/* Boards searched before giving up, which keeps an answer to a few
+ * milliseconds */
+#define PC_NODES_MAX 20000
+
+typedef struct {
+	size_t n; /* Hidamaries placed */
+	/* Each hidamari as it locks, on the board left by the ones before */
+	Hidamari placed[PC_PIECES_MAX];
+} PCSolution;
+
+/* Search for a perfect clear of _field_ with at most _max_pieces_ coming
+ * hidamaries, fewest rows first.
+ *
+ * Return: 1 if one was found, 0 if there is none, or -1 if the search ran
+ *	out of memory or boards to try.
+ */
+int
+pc_solve(HidamariPlayField const *field, size_t max_pieces, PCSolution *sol);
+
+/* Inputs towards a perfect clear, as ai_plan() returns them, for the first
+ * placement of the one pc_solve() finds.
+ *
+ * Return: The BUTTON_NONE terminated inputs, or NULL if there is no
+ *	perfect clear to be found or the inputs cannot reach it.
+ */
+Button const *
+pc_plan(void *region, HidamariPlayField const *field, size_t max_pieces);
+
+#endif
@@ -0,0 +1,426 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "field.h"
+#include "hidamari.h"
+#include "region.h"
+#include "vector.h"
+
+/* Count the positions reachable from a seeded board in a number of pieces,
+ * as a benchmark and a check of move generation. Each distinct placement
+ * of each hidamari is a position, and the boards left by them are counted
+ * once each per depth, told apart by a 64-bit hash of the grid.
+ *
+ * Placements come from dropping the hidamari straight down in every
+ * orientation and column, or from the search's own ai_expand(). Checking
+ * compares the two at every position. */
+
+#define DEPTH_MAX 16
+#define THREADS_MAX 256
+/* Every orientation of a hidamari, in every column it can be dropped */
+#define MOVES_MAX (4 * (HIDAMARI_WIDTH + 3))
+
+#define BOARD_HASH(k) (k)
+#define BOARD_EQUAL(a, b) ((a) == (b))
+
+/* Boards seen, keyed by their hash mixed with their depth */
+HASHMAP_INSTANTIATE(BoardSet, u64, u8, BOARD_HASH, BOARD_EQUAL, vec_heap)
+
+enum {
+	GEN_DROP,
+	GEN_SEARCH,
+};
+
+typedef struct {
+	Hidamari placed;
+	HidamariPlayField field;
+	int state;
+} Move;
+
+typedef struct Perft Perft;
+
+typedef struct {
+	Perft *perft;
+	pthread_t thread;
+	void *region;
+	u64 nodes[DEPTH_MAX + 1];
+	u64 missing; /* Dropped placements the search does not make */
+	u64 extra; /* Search placements no drop makes */
+	BoardSet seen;
+	bool oom;
+} Worker;
+
+struct Perft {
+	size_t depth;
+	int gen;
+	bool check;
+	size_t n_root;
+	Move root[MOVES_MAX];
+	u64 divide[MOVES_MAX]; /* Positions at full depth under each root */
+	_Atomic size_t next; /* Index of the next root to count */
+};
+
+char *argv0;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-d] [-c] [-g drop|search] [-j threads] "
+			"[-r replay pieces] [depth] [seed]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64
+mix(u64 h, u64 v)
+{
+	h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static u64
+board_key(HidamariPlayField const *field, size_t depth)
+{
+	int y;
+	u64 h = depth;
+
+	for (y = 1; y < HIDAMARI_HEIGHT; ++y) {
+		h = mix(h, field->grid[y]);
+	}
+	return h;
+}
+
+/* Add a placement unless one with the same cells is already there */
+static size_t
+add_move(Move move[], size_t n, Hidamari const *placed,
+		HidamariPlayField const *field, int state)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (field_same_cells(&move[i].placed, placed))
+			return n;
+	}
+	move[n].placed = *placed;
+	move[n].field = *field;
+	move[n].state = state;
+	return n + 1;
+}
+
+/* Drop the current hidamari straight down in every orientation and column
+ * it fits in where it spawns */
+static size_t
+gen_drop(HidamariPlayField const *field, Move move[])
+{
+	int o, x, state;
+	size_t n = 0;
+	Hidamari t;
+	HidamariPlayField child;
+
+	for (o = 0; o < 4; ++o) {
+		for (x = -2; x < HIDAMARI_WIDTH + 1; ++x) {
+			t = field->current;
+			t.orientation = o;
+			t.pos.x = x;
+			child = *field;
+			state = field_place(&child, &t);
+			if (0 > state)
+				continue;
+			n = add_move(move, n, &t, &child, state);
+		}
+	}
+	return n;
+}
+
+/* Expand the position as the search does */
+static size_t
+gen_search(Worker *w, HidamariPlayField const *field, Move move[])
+{
+	size_t n = 0;
+	FieldNode root, *stack = NULL, *fp;
+
+	memset(&root, 0, sizeof(root));
+	root.field = *field;
+	region_clear(w->region);
+	if (0 > ai_expand(w->region, &stack, &root)) {
+		w->oom = true;
+		return 0;
+	}
+	for (fp = stack; fp; fp = fp->next) {
+		n = add_move(move, n, &fp->placed, &fp->field, fp->dead
+				? HIDAMARI_GS_GAME_OVER : HIDAMARI_GS_GAME_PLAYING);
+	}
+	return n;
+}
+
+/* Count the placements one generator makes that the other does not */
+static u64
+unmatched(Move const a[], size_t n_a, Move const b[], size_t n_b)
+{
+	size_t i, j;
+	u64 n = 0;
+
+	for (i = 0; i < n_a; ++i) {
+		for (j = 0; j < n_b; ++j) {
+			if (field_same_cells(&a[i].placed, &b[j].placed))
+				break;
+		}
+		n += j == n_b;
+	}
+	return n;
+}
+
+static size_t
+generate(Worker *w, HidamariPlayField const *field, Move move[])
+{
+	size_t n, n_other;
+	Move other[MOVES_MAX];
+
+	if (GEN_SEARCH == w->perft->gen) {
+		n = gen_search(w, field, move);
+	} else {
+		n = gen_drop(field, move);
+	}
+	if (!w->perft->check)
+		return n;
+	if (GEN_SEARCH == w->perft->gen) {
+		n_other = gen_drop(field, other);
+		w->missing += unmatched(other, n_other, move, n);
+		w->extra += unmatched(move, n, other, n_other);
+	} else {
+		n_other = gen_search(w, field, other);
+		w->missing += unmatched(move, n, other, n_other);
+		w->extra += unmatched(other, n_other, move, n);
+	}
+	return n;
+}
+
+/* Count the positions a move leads to, down to the full depth.
+ *
+ * Return: The number of positions at the full depth.
+ */
+static u64
+count(Worker *w, Move const *m, size_t d)
+{
+	size_t i, n;
+	u64 leaves = 0;
+	u8 *seen;
+	Move move[MOVES_MAX];
+
+	w->nodes[d] += 1;
+	seen = BoardSet_get(&w->seen, board_key(&m->field, d), NULL);
+	if (!seen) {
+		w->oom = true;
+		return 0;
+	}
+	*seen = d;
+	if (d == w->perft->depth)
+		return 1;
+	if (HIDAMARI_GS_GAME_PLAYING != m->state)
+		return 0;
+	n = generate(w, &m->field, move);
+	for (i = 0; i < n; ++i) {
+		leaves += count(w, &move[i], d + 1);
+	}
+	return leaves;
+}
+
+static void *
+work(void *arg)
+{
+	size_t i;
+	Worker *w = arg;
+	Perft *p = w->perft;
+
+	for (;;) {
+		i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed);
+		if (i >= p->n_root)
+			break;
+		p->divide[i] = count(w, &p->root[i], 1);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	size_t i, d, n_thread = 1, n_started = 0, replay = 0;
+	u32 seed = 1;
+	u64 total = 0;
+	u64 nodes[DEPTH_MAX + 1] = {0}, boards[DEPTH_MAX + 1] = {0};
+	u64 missing = 0, extra = 0;
+	u64 key;
+	u8 *depth, *merged;
+	bool divide = false, oom = false;
+	double start, elapsed;
+	void *region;
+	HidamariAIConfig config;
+	HidamariGame game;
+	HidamariPlayField field;
+	AIChoice choice;
+	BoardSet seen = HASHMAP_ZERO;
+	Worker *worker;
+	static Perft perft = {
+		.depth = 3,
+	};
+
+	argv0 = argv[0];
+	while (-1 != (opt = getopt(argc, argv, "dcg:j:r:"))) {
+		switch (opt) {
+		case 'd':
+			divide = true;
+			break;
+		case 'c':
+			perft.check = true;
+			break;
+		case 'g':
+			if (0 == strcmp(optarg, "drop")) {
+				perft.gen = GEN_DROP;
+			} else if (0 == strcmp(optarg, "search")) {
+				perft.gen = GEN_SEARCH;
+			} else {
+				usage();
+			}
+			break;
+		case 'j':
+			n_thread = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			replay = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc > 3)
+		usage();
+	if (argc > 1)
+		perft.depth = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		seed = strtoul(argv[2], NULL, 10);
+	if (0 == perft.depth || perft.depth > DEPTH_MAX) {
+		fprintf(stderr, "error: Depth must be 1 to %d\n", DEPTH_MAX);
+		return EXIT_FAILURE;
+	}
+	if (0 == n_thread)
+		n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+	n_thread = n_thread < THREADS_MAX ? n_thread : THREADS_MAX;
+	worker = calloc(n_thread, sizeof(*worker));
+	if (!worker) {
+		fprintf(stderr, "error: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Reach the starting board by letting the AI play from the seed */
+	field_init(&field, seed);
+	hidamari_init(&game, NULL);
+	config = *hidamari_ai_config(&game);
+	config.n_thread = 1;
+	region = region_borrow(ai_size_requirement());
+	for (i = 0; i < replay; ++i) {
+		region_clear(region);
+		ai_choose(region, &config, &field, &choice);
+		if (HIDAMARI_GS_GAME_PLAYING != field_place(&field, &choice.placed)) {
+			fprintf(stderr, "error: The game ended after %zu pieces\n",
+					i + 1);
+			return EXIT_FAILURE;
+		}
+	}
+	region_return(region);
+
+	start = now();
+	for (i = 0; i < n_thread; ++i) {
+		worker[i].perft = &perft;
+		worker[i].region = region_borrow(ai_size_requirement());
+		BoardSet_init(&worker[i].seen, NULL);
+		if (!worker[i].region) {
+			fprintf(stderr, "error: Out of memory\n");
+			return EXIT_FAILURE;
+		}
+	}
+	perft.n_root = generate(&worker[0], &field, perft.root);
+	atomic_init(&perft.next, 0);
+	/* Whatever threads cannot be started, the main one makes up for */
+	for (i = 1; i < n_thread; ++i) {
+		if (0 != pthread_create(&worker[i].thread, NULL, work, &worker[i]))
+			break;
+		n_started += 1;
+	}
+	work(&worker[0]);
+	for (i = 1; i <= n_started; ++i) {
+		pthread_join(worker[i].thread, NULL);
+	}
+
+	/* Gather the counts, and the boards each worker saw */
+	for (i = 0; i < n_thread; ++i) {
+		for (d = 1; d <= perft.depth; ++d) {
+			nodes[d] += worker[i].nodes[d];
+		}
+		missing += worker[i].missing;
+		extra += worker[i].extra;
+		oom |= worker[i].oom;
+		for (d = 0; BoardSet_next(&worker[i].seen, &d, &key, &depth);) {
+			merged = BoardSet_get(&seen, key, NULL);
+			if (!merged) {
+				oom = true;
+				break;
+			}
+			*merged = *depth;
+		}
+		BoardSet_free(&worker[i].seen);
+		region_return(worker[i].region);
+	}
+	for (d = 0; BoardSet_next(&seen, &d, &key, &depth);) {
+		boards[*depth] += 1;
+	}
+	elapsed = now() - start;
+	if (oom) {
+		fprintf(stderr, "error: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (divide) {
+		for (i = 0; i < perft.n_root; ++i) {
+			printf("%c%d x=%d y=%d: %llu\n",
+					hidamari_shape_char[perft.root[i].placed.shape],
+					perft.root[i].placed.orientation,
+					perft.root[i].placed.pos.x,
+					perft.root[i].placed.pos.y,
+					(unsigned long long)perft.divide[i]);
+		}
+	}
+	for (d = 1; d <= perft.depth; ++d) {
+		printf("depth %zu: %llu positions, %llu boards\n", d,
+				(unsigned long long)nodes[d],
+				(unsigned long long)boards[d]);
+		total += nodes[d];
+	}
+	printf("%llu positions in %.3fs, %.1f positions/s\n",
+			(unsigned long long)total, elapsed, total / elapsed);
+	if (perft.check) {
+		printf("%llu placements missed and %llu extra by the search\n",
+				(unsigned long long)missing, (unsigned long long)extra);
+	}
+	BoardSet_free(&seen);
+	free(worker);
+	return perft.check && (missing || extra) ? EXIT_FAILURE : 0;
+}
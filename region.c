@@ -1,15 +1,23 @@
 /* See LICENSE file for copyright and license details */
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include "region.h"
 
-typedef struct {
+typedef struct Region Region;
+struct Region {
 	uint8_t *mem;
 	size_t sp;
 	size_t size;
-} Region;
+	Region *next; /* Next spare region in the pool */
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key; /* The region cached by each thread */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Region *pool; /* Spare regions not cached by any thread */
 
 static bool
 overflows(size_t a, size_t b)
@@ -23,6 +31,10 @@ region_alloc(void *handle, size_t n)
 	void *ret;
 	Region *region = handle;
 
+	if (overflows(n, REGION_ALIGN)) {
+		return NULL;
+	}
+	n = REGION_SIZE(n);
 	if (overflows(region->sp, n) || region->sp + n > region->size) {
 		return NULL;
 	}
@@ -39,14 +51,24 @@ region_clear(void *handle)
 	region->sp = 0;
 }
 
+void
+region_rewind(void *handle, size_t used)
+{
+	Region *region = handle;
+
+	if (used < region->sp)
+		region->sp = used;
+}
+
 void *
 region_create(size_t n)
 {
-	Region *region = malloc(sizeof(*region) + n);
+	Region *region = malloc(REGION_SIZE(sizeof(*region)) + n);
 
-	region->mem = (uint8_t *) (region + 1);
+	region->mem = (uint8_t *)region + REGION_SIZE(sizeof(*region));
 	region->sp = 0;
 	region->size = n;
+	region->next = NULL;
 	return region;
 }
 
@@ -61,3 +83,68 @@ region_size()
 {
 	return sizeof(Region);
 }
+
+size_t
+region_used(void const *handle)
+{
+	Region const *region = handle;
+
+	return region->sp;
+}
+
+/* A thread's cached region is freed when the thread exits */
+static void
+pool_release(void *region)
+{
+	region_destroy(region);
+}
+
+static void
+pool_init(void)
+{
+	pthread_key_create(&pool_key, pool_release);
+}
+
+void *
+region_borrow(size_t n)
+{
+	Region *region;
+	Region **rp;
+
+	pthread_once(&pool_once, pool_init);
+	region = pthread_getspecific(pool_key);
+	if (region && region->size >= n) {
+		pthread_setspecific(pool_key, NULL);
+	} else {
+		region = NULL;
+		pthread_mutex_lock(&pool_lock);
+		for (rp = &pool; *rp; rp = &(*rp)->next) {
+			if ((*rp)->size >= n) {
+				region = *rp;
+				*rp = region->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&pool_lock);
+		if (!region)
+			region = region_create(n);
+	}
+	region_clear(region);
+	return region;
+}
+
+void
+region_return(void *handle)
+{
+	Region *region = handle;
+
+	pthread_once(&pool_once, pool_init);
+	if (!pthread_getspecific(pool_key)) {
+		pthread_setspecific(pool_key, region);
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	region->next = pool;
+	pool = region;
+	pthread_mutex_unlock(&pool_lock);
+}
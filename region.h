@@ -4,6 +4,12 @@
 
 #include <stdlib.h>
 
+/* Allocations from a region are aligned to this many bytes */
+#define REGION_ALIGN 16
+
+/* The space taken up in a region by an allocation of _n_ bytes */
+#define REGION_SIZE(n) (((n) + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1))
+
 void *
 region_alloc(void *region, size_t n);
 
@@ -11,6 +17,11 @@ region_alloc(void *region, size_t n);
 void
 region_clear(void *region);
 
+/* Drop what was allocated from a region after it had _used_ bytes in use,
+ * as told by region_used() */
+void
+region_rewind(void *region, size_t used);
+
 void *
 region_create(size_t n);
 
@@ -20,4 +31,19 @@ region_destroy(void const *region);
 size_t
 region_size();
 
+/* Number of bytes allocated from a region since it was last cleared */
+size_t
+region_used(void const *region);
+
+/* Borrow a cleared region of at least _n_ bytes from the pool. The region
+ * last returned by the calling thread is reused when it is large enough, so
+ * a thread that plans repeatedly keeps working in the same memory. */
+void *
+region_borrow(size_t n);
+
+/* Give a borrowed region back to the pool. The calling thread keeps it
+ * cached for its next borrow, and frees it when the thread exits. */
+void
+region_return(void *region);
+
 #endif
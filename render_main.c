@@ -0,0 +1,419 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <png.h>
+
+#include "ai.h"
+#include "compose.h"
+#include "hidamari.h"
+#include "vector.h"
+
+/* Render a seeded AI game to raw video, headless and faster than real
+ * time. The game is played once, recording the input of every timestep
+ * and a copy of the game at the start of every chunk of timesteps. The
+ * chunks are then replayed from their copies by as many threads as there
+ * are CPUs, each drawing its frames with the software compositor, and
+ * written out in order. A frame whose buffer is the same as the one before
+ * it is not drawn again but copied. */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TILESET "res/tileset/default.png"
+#define TILE_S 16
+#define WIDTH COMPOSE_WIDTH(TILE_S)
+#define HEIGHT COMPOSE_HEIGHT(TILE_S)
+/* Timesteps in each chunk of frames rendered by a thread */
+#define CHUNK 64
+#define THREADS_MAX 256
+
+typedef enum {
+	FORMAT_Y4M,
+	FORMAT_PPM,
+} Format;
+
+VECTOR_INSTANTIATE(ButtonVec, Button, vec_heap)
+VECTOR_INSTANTIATE(GameVec, HidamariGame, vec_heap)
+
+typedef struct {
+	u8 *data; /* CHUNK encoded frames */
+	size_t len;
+	bool ready;
+} Slot;
+
+typedef struct {
+	Format format;
+	ComposeTileset tileset;
+	size_t frame_size; /* Bytes of an encoded frame */
+	ButtonVec input; /* Of every timestep */
+	GameVec start; /* Game at the start of every chunk */
+	size_t n_chunk;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* Signalled when a chunk is ready or written */
+	size_t next; /* Next chunk to render */
+	size_t written; /* Chunks written out */
+	size_t n_slot; /* Chunks rendered ahead of the one written */
+	Slot *slot;
+	u64 drawn; /* Frames that had to be drawn */
+} Render;
+
+/* Memory a thread renders with */
+typedef struct {
+	Render *render;
+	HidamariBuffer buf;
+	HidamariBuffer prev; /* Last buffer drawn */
+	u8 fb[WIDTH * HEIGHT * 4];
+} Scratch;
+
+char *argv0;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-j threads] [-f y4m|ppm] <output file|-> "
+			"[lines] [seed] [weights file]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+load_tileset(ComposeTileset *tileset)
+{
+	int ret;
+	png_image image;
+	u8 *rgba;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&image, TILESET))
+		return -1;
+	image.format = PNG_FORMAT_RGBA;
+	rgba = malloc(PNG_IMAGE_SIZE(image));
+	if (!rgba) {
+		png_image_free(&image);
+		return -1;
+	}
+	if (!png_image_finish_read(&image, NULL, rgba, 0, NULL)) {
+		free(rgba);
+		return -1;
+	}
+	ret = compose_tileset_init(tileset, rgba, image.width, image.height,
+			PNG_IMAGE_ROW_STRIDE(image), TILE_S);
+	free(rgba);
+	return ret;
+}
+
+/* The header of a Y4M stream, or of each PPM frame */
+static int
+header(Format format, char *out, size_t n)
+{
+	/* A timestep takes 1000 / 60 milliseconds, rounded down, as in the
+	 * game itself */
+	if (FORMAT_Y4M == format)
+		return snprintf(out, n, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n",
+				WIDTH, HEIGHT, 1000, 1000 / 60);
+	return snprintf(out, n, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+}
+
+/* Convert an RGBA framebuffer to a frame in _format_, of frame_size bytes */
+static void
+encode(Format format, u8 const *fb, u8 *out)
+{
+	int x, y, i, j, r, g, b;
+	u8 const *p;
+	u8 *u, *v;
+
+	if (FORMAT_PPM == format) {
+		out += header(format, (char *)out, 32);
+		for (i = 0; i < WIDTH * HEIGHT; ++i) {
+			*out++ = fb[4 * i];
+			*out++ = fb[4 * i + 1];
+			*out++ = fb[4 * i + 2];
+		}
+		return;
+	}
+	/* BT.601 in studio range, with the chroma of each 2x2 block averaged */
+	memcpy(out, "FRAME\n", 6);
+	out += 6;
+	for (i = 0; i < WIDTH * HEIGHT; ++i) {
+		p = &fb[4 * i];
+		out[i] = 16 + ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8);
+	}
+	u = out + WIDTH * HEIGHT;
+	v = u + WIDTH * HEIGHT / 4;
+	for (y = 0; y < HEIGHT; y += 2) {
+		for (x = 0; x < WIDTH; x += 2) {
+			r = g = b = 0;
+			for (j = 0; j < 4; ++j) {
+				p = &fb[4 * ((y + j / 2) * WIDTH + x + j % 2)];
+				r += p[0];
+				g += p[1];
+				b += p[2];
+			}
+			*u++ = 128 + ((-38 * r - 74 * g + 112 * b + 512) >> 10);
+			*v++ = 128 + ((112 * r - 94 * g - 18 * b + 512) >> 10);
+		}
+	}
+}
+
+/* Replay chunk _k_ into its slot */
+static void
+render_chunk(Render *r, size_t k, Scratch *s)
+{
+	size_t t, end = MIN((k + 1) * CHUNK, r->input.len);
+	u8 *out;
+	u64 drawn = 0;
+	HidamariGame game = r->start.data[k];
+	Slot *slot = &r->slot[k % r->n_slot];
+
+	game.buf = &s->buf;
+	game.ai.active = false;
+	out = slot->data;
+	for (t = k * CHUNK; t < end; ++t) {
+		hidamari_update(&game, r->input.data[t]);
+		if (t > k * CHUNK && 0 == memcmp(&s->buf, &s->prev, sizeof(s->buf))) {
+			memcpy(out, out - r->frame_size, r->frame_size);
+		} else {
+			compose(&r->tileset, &s->buf, s->fb, WIDTH * 4);
+			encode(r->format, s->fb, out);
+			s->prev = s->buf;
+			drawn += 1;
+		}
+		out += r->frame_size;
+	}
+	pthread_mutex_lock(&r->lock);
+	slot->len = out - slot->data;
+	slot->ready = true;
+	r->drawn += drawn;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Claim the next chunk, once there is a slot for it, and render it.
+ *
+ * Return: false if every chunk has been claimed.
+ */
+static bool
+render_next(Render *r, Scratch *s)
+{
+	size_t k;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->next < r->n_chunk && r->next >= r->written + r->n_slot)
+		pthread_cond_wait(&r->cond, &r->lock);
+	k = r->next;
+	if (k < r->n_chunk)
+		r->next += 1;
+	pthread_mutex_unlock(&r->lock);
+	if (k >= r->n_chunk)
+		return false;
+	render_chunk(r, k, s);
+	return true;
+}
+
+static void *
+work(void *arg)
+{
+	Scratch *s = arg;
+
+	while (render_next(s->render, s))
+		;
+	return NULL;
+}
+
+/* Play the game, recording its inputs and the start of each chunk.
+ *
+ * Return: 0, or -1 if out of memory.
+ */
+static int
+record(Render *r, HidamariGame *game, u32 max_lines)
+{
+	while (HIDAMARI_GS_GAME_PLAYING == game->state
+	    && game->field.lines < max_lines) {
+		if (0 == r->input.len % CHUNK
+		    && 0 > GameVec_push(&r->start, *game))
+			return -1;
+		hidamari_update(game, BUTTON_NONE);
+		if (0 > ButtonVec_push(&r->input,
+				game->ai.plan[game->ai.plan_pos - 1]))
+			return -1;
+	}
+	r->n_chunk = r->start.len;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	size_t i, n_thread = 0, n_started = 0;
+	u32 max_lines = 200, seed = 1;
+	double start, played, elapsed;
+	char head[64];
+	bool ok = true;
+	FILE *fp;
+	pthread_t thread[THREADS_MAX];
+	HidamariGame game;
+	HidamariAIConfig config;
+	Slot *slot;
+	Scratch *scratch;
+	Render r = { .format = FORMAT_Y4M };
+
+	argv0 = argv[0];
+	while (-1 != (opt = getopt(argc, argv, "j:f:"))) {
+		switch (opt) {
+		case 'j':
+			n_thread = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			if (0 == strcmp(optarg, "y4m"))
+				r.format = FORMAT_Y4M;
+			else if (0 == strcmp(optarg, "ppm"))
+				r.format = FORMAT_PPM;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2 || argc > 5)
+		usage();
+	if (argc > 2)
+		max_lines = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		seed = strtoul(argv[3], NULL, 10);
+	if (argc > 4 && 0 > ai_config_load(&config, argv[4])) {
+		fprintf(stderr, "error: Could not read AI weights from %s\n", argv[4]);
+		return EXIT_FAILURE;
+	}
+	if (0 > load_tileset(&r.tileset)) {
+		fprintf(stderr, "error: Could not load %s\n", TILESET);
+		return EXIT_FAILURE;
+	}
+	fp = 0 == strcmp(argv[1], "-") ? stdout : fopen(argv[1], "wb");
+	if (!fp) {
+		fprintf(stderr, "error: Could not write to %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	hidamari_init(&game, NULL);
+	game.ai.active = true;
+	if (argc > 4)
+		game.ai.config = &config;
+	hidamari_start(&game, seed);
+	ButtonVec_init(&r.input, NULL);
+	GameVec_init(&r.start, NULL);
+	if (0 > record(&r, &game, max_lines)) {
+		fprintf(stderr, "error: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	played = now() - start;
+
+	if (0 == n_thread)
+		n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+	n_thread = MIN(MIN(n_thread, THREADS_MAX), r.n_chunk);
+	if (0 == n_thread)
+		n_thread = 1;
+	r.frame_size = WIDTH * HEIGHT * 3;
+	if (FORMAT_Y4M == r.format)
+		r.frame_size = 6 + WIDTH * HEIGHT * 3 / 2;
+	else
+		r.frame_size += header(r.format, head, sizeof(head));
+	/* Enough chunks in flight for every thread to keep busy while the
+	 * oldest is written */
+	r.n_slot = 2 * n_thread + 1;
+	r.slot = calloc(r.n_slot, sizeof(*r.slot));
+	for (i = 0; r.slot && i < r.n_slot; ++i) {
+		r.slot[i].data = malloc(CHUNK * r.frame_size);
+		if (!r.slot[i].data)
+			ok = false;
+	}
+	scratch = malloc(n_thread * sizeof(*scratch));
+	for (i = 0; scratch && i < n_thread; ++i) {
+		/* Only the playfield is drawn by the game, the rest stays
+		 * blank */
+		scratch[i].render = &r;
+		memset(&scratch[i].buf, 0, sizeof(scratch[i].buf));
+		memset(scratch[i].buf.tile, HIDAMARI_TILE_SPACE,
+				sizeof(scratch[i].buf.tile));
+	}
+	if (!r.slot || !scratch || !ok) {
+		fprintf(stderr, "error: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	if (FORMAT_Y4M == r.format) {
+		header(r.format, head, sizeof(head));
+		ok = EOF != fputs(head, fp);
+	}
+
+	/* The main thread writes the chunks out in order as they are ready,
+	 * and renders only if no thread can be started */
+	for (i = 0; i < n_thread; ++i) {
+		if (0 != pthread_create(&thread[n_started], NULL, work,
+				&scratch[n_started]))
+			break;
+		n_started += 1;
+	}
+	for (i = 0; i < r.n_chunk; ++i) {
+		if (0 == n_started)
+			render_next(&r, &scratch[0]);
+		slot = &r.slot[i % r.n_slot];
+		pthread_mutex_lock(&r.lock);
+		while (!slot->ready)
+			pthread_cond_wait(&r.cond, &r.lock);
+		pthread_mutex_unlock(&r.lock);
+		if (ok && slot->len != fwrite(slot->data, 1, slot->len, fp))
+			ok = false;
+		pthread_mutex_lock(&r.lock);
+		slot->ready = false;
+		r.written += 1;
+		pthread_cond_broadcast(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+	}
+	for (i = 0; i < n_started; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	if (0 != fflush(fp) || (stdout != fp && 0 != fclose(fp)))
+		ok = false;
+	elapsed = now() - start;
+	if (ok) {
+		fprintf(stderr, "%zu frames, %llu drawn, %.1fs of game in %.3fs "
+				"(%.3fs playing)\n", r.input.len,
+				(unsigned long long)r.drawn,
+				r.input.len * (1000 / 60) / 1000.0, elapsed, played);
+	}
+
+	for (i = 0; i < r.n_slot; ++i) {
+		free(r.slot[i].data);
+	}
+	free(r.slot);
+	free(scratch);
+	ButtonVec_free(&r.input);
+	GameVec_free(&r.start);
+	compose_tileset_free(&r.tileset);
+	if (!ok) {
+		fprintf(stderr, "error: Could not write all frames\n");
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
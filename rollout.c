@@ -0,0 +1,240 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "field.h"
+#include "hidamari.h"
+#include "rollout.h"
+#include "telemetry.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* The playouts of one call of rollout_score(), shared by the calling
+ * thread and the pool */
+typedef struct Rollout Rollout;
+struct Rollout {
+	HidamariAIConfig const *config;
+	u32 seed;
+	HidamariPlayField const *const *cand;
+	size_t n_cand;
+	size_t n_per; /* Playouts from each candidate */
+	_Atomic size_t next; /* Index of the next playout to run */
+	long long *score;
+	size_t helpers; /* Pool threads running its playouts */
+	size_t max_helpers;
+	pthread_cond_t done; /* Signalled when the last helper finishes */
+	Rollout *queued; /* Next call waiting for the pool */
+};
+
+/* Threads that help run the playouts of every call, started as they are
+ * first needed and kept for the life of the process, so planning does not
+ * start threads of its own for every decision */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static size_t n_pool;
+static Rollout *jobs; /* Calls the pool may help with, newest first */
+
+/* Derive the seed of the _i_th playout from each candidate. Neighbouring
+ * indices give unrelated seeds, and never the zero state xorshift cannot
+ * leave. */
+static u32
+playout_seed(u32 seed, size_t i)
+{
+	u32 x = seed ^ (u32)(i * 0x9e3779b9u);
+
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x ? x : 1;
+}
+
+/* Place the current hidamari where the resulting position scores best by
+ * the weights of _config_, preferring any placement that does not top out.
+ *
+ * Return: HIDAMARI_GS_GAME_OVER if every placement tops out, otherwise
+ *	HIDAMARI_GS_GAME_PLAYING.
+ */
+static int
+greedy(HidamariPlayField *field, HidamariAIConfig const *config)
+{
+	size_t i;
+	int o, x;
+	bool found = false;
+	double f[HIDAMARI_FEATURE_LAST];
+	double score, best = 0;
+	Hidamari t;
+	HidamariPlayField tmp, next;
+
+	for (o = 0; o < 4; ++o) {
+		for (x = -2; x < HIDAMARI_WIDTH; ++x) {
+			tmp = *field;
+			t = field->current;
+			t.orientation = o;
+			t.pos.x = x;
+			if (HIDAMARI_GS_GAME_PLAYING != field_place(&tmp, &t))
+				continue;
+			ai_features(&tmp, field, &t, config->n_weight, f);
+			score = 0;
+			for (i = 0; i < config->n_weight; ++i) {
+				score += config->weight[i] * f[i];
+			}
+			if (!found || score < best) {
+				next = tmp;
+				best = score;
+				found = true;
+			}
+		}
+	}
+	if (!found)
+		return HIDAMARI_GS_GAME_OVER;
+	*field = next;
+	return HIDAMARI_GS_GAME_PLAYING;
+}
+
+static long long
+playout(HidamariAIConfig const *config, HidamariPlayField const *init, u32 seed)
+{
+	u32 i;
+	HidamariPlayField field = *init;
+
+	field.rng = seed;
+	for (i = 0; i < config->playout_depth; ++i) {
+		if (HIDAMARI_GS_GAME_OVER == greedy(&field, config))
+			return (long long)field.lines - (config->playout_depth - i);
+	}
+	return field.lines;
+}
+
+/* Run playouts of _r_ until none are left, adding up their scores by
+ * candidate. Every candidate plays the same piece sequences, so they are
+ * compared on common random numbers. */
+static void
+run(Rollout *r, long long score[ROLLOUT_CANDIDATES])
+{
+	size_t i, c;
+
+	for (;;) {
+		i = atomic_fetch_add_explicit(&r->next, 1, memory_order_relaxed);
+		if (i >= r->n_cand * r->n_per)
+			break;
+		c = i / r->n_per;
+		score[c] += playout(r->config, r->cand[c],
+				playout_seed(r->seed, i % r->n_per));
+	}
+}
+
+/* Whether the pool can help with _r_. The lock must be held. */
+static bool
+wants_help(Rollout *r)
+{
+	return r->helpers < r->max_helpers
+		&& atomic_load_explicit(&r->next, memory_order_relaxed)
+		   < r->n_cand * r->n_per;
+}
+
+static void *
+work(void *arg)
+{
+	size_t c;
+	long long score[ROLLOUT_CANDIDATES];
+	Rollout *r;
+
+	(void)arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		for (r = jobs; r && !wants_help(r); r = r->queued)
+			;
+		if (!r) {
+			pthread_cond_wait(&pool_work, &pool_lock);
+			continue;
+		}
+		r->helpers += 1;
+		pthread_mutex_unlock(&pool_lock);
+
+		for (c = 0; c < ROLLOUT_CANDIDATES; ++c) {
+			score[c] = 0;
+		}
+		run(r, score);
+
+		pthread_mutex_lock(&pool_lock);
+		for (c = 0; c < r->n_cand; ++c) {
+			r->score[c] += score[c];
+		}
+		r->helpers -= 1;
+		if (0 == r->helpers)
+			pthread_cond_signal(&r->done);
+	}
+	return NULL;
+}
+
+size_t
+rollout_score(HidamariAIConfig const *config, u32 seed,
+		HidamariPlayField const *const cand[], size_t n_cand,
+		long long score[])
+{
+	size_t i;
+	size_t n_thread;
+	long long own[ROLLOUT_CANDIDATES] = {0};
+	pthread_t thread;
+	Rollout **rp;
+	Rollout r = {
+		.config = config,
+		.seed = seed,
+		.cand = cand,
+		.n_cand = MIN(n_cand, ROLLOUT_CANDIDATES),
+		.n_per = MAX(1, config->n_playout / MAX(1, n_cand)),
+		.score = score,
+	};
+
+	for (i = 0; i < r.n_cand; ++i) {
+		score[i] = 0;
+	}
+	n_thread = config->n_thread;
+	if (0 == n_thread)
+		n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+	n_thread = MIN(n_thread, MIN(r.n_cand * r.n_per, ROLLOUT_THREADS_MAX));
+	atomic_init(&r.next, 0);
+	if (n_thread <= 1) {
+		run(&r, score);
+		telemetry_count(TELEMETRY_PLAYOUTS, r.n_cand * r.n_per);
+		return r.n_per;
+	}
+
+	/* Whatever threads cannot be started, the calling one makes up for */
+	r.max_helpers = n_thread - 1;
+	pthread_cond_init(&r.done, NULL);
+	pthread_mutex_lock(&pool_lock);
+	while (n_pool < r.max_helpers) {
+		if (0 != pthread_create(&thread, NULL, work, NULL))
+			break;
+		pthread_detach(thread);
+		n_pool += 1;
+	}
+	r.queued = jobs;
+	jobs = &r;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	run(&r, own);
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < r.n_cand; ++i) {
+		score[i] += own[i];
+	}
+	for (rp = &jobs; *rp != &r; rp = &(*rp)->queued)
+		;
+	*rp = r.queued;
+	while (r.helpers > 0)
+		pthread_cond_wait(&r.done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+	pthread_cond_destroy(&r.done);
+	telemetry_count(TELEMETRY_PLAYOUTS, r.n_cand * r.n_per);
+	return r.n_per;
+}
@@ -0,0 +1,42 @@
+/* See LICENSE file for copyright and license details */
+#ifndef ROLLOUT_H
+#define ROLLOUT_H
+
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* Most candidate positions scored by one call of rollout_score() */
+#define ROLLOUT_CANDIDATES 8
+
+/* Most threads running the playouts of one call of rollout_score() */
+#define ROLLOUT_THREADS_MAX 64
+
+/* Score candidate positions by Monte Carlo playouts. From each candidate,
+ * config->n_playout / n_cand playouts are run, each of which places up to
+ * config->playout_depth hidamaries where they score best by the weights of
+ * _config_. Only the pieces left in the current bag are known, the ones
+ * after it are drawn anew for every playout.
+ *
+ * A playout scores the lines cleared since the start of the game, less one
+ * for each hidamari it fails to place because the stack topped out, so the
+ * candidates must all share the same starting position.
+ *
+ * The playouts are spread over config->n_thread threads, the calling one
+ * included. The others come from a pool shared by every caller, started
+ * as it first needs them and kept for the life of the process. The _k_th
+ * playout of every candidate is seeded from _seed_ and _k_, so candidates
+ * are compared on the same piece sequences, and the scores do not depend
+ * on the number of threads.
+ *
+ * Parameters:
+ *	- score: Receives the sum of the playout scores of each candidate.
+ *
+ * Return: The number of playouts run from each candidate.
+ */
+size_t
+rollout_score(HidamariAIConfig const *config, u32 seed,
+		HidamariPlayField const *const cand[], size_t n_cand,
+		long long score[]);
+
+#endif
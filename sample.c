@@ -0,0 +1,140 @@
+/* See LICENSE file for copyright and license details */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai.h"
+#include "hidamari.h"
+#include "sample.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+struct SampleWriter {
+	pthread_mutex_t lock;
+	char *prefix;
+	unsigned number; /* Of the current chunk */
+	FILE *fp;
+	size_t chunk;
+	size_t in_chunk; /* Samples in the current chunk */
+	bool error;
+};
+
+void
+sample_make(HidamariPlayField const *field, AIChoice const *choice,
+		Sample *sample)
+{
+	int x, y;
+	size_t bit = 0;
+
+	memset(sample, 0, sizeof(*sample));
+	sample->score = choice->score;
+	sample->shape = field->current.shape;
+	sample->next = field->next;
+	sample->orientation = choice->placed.orientation;
+	sample->x = choice->placed.pos.x;
+	sample->y = choice->placed.pos.y;
+	for (y = 0; y < HIDAMARI_HEIGHT; ++y) {
+		for (x = 0; x < HIDAMARI_WIDTH; ++x, ++bit) {
+			if (field->grid[y] & (HidamariRow)1 << x)
+				sample->grid[bit / 8] |= 1 << bit % 8;
+		}
+	}
+}
+
+/* Make the next chunk that does not exist yet.
+ *
+ * Return: 0 on success, otherwise -1.
+ */
+static int
+next_chunk(SampleWriter *writer)
+{
+	char path[4096];
+	SampleHeader header = {
+		.width = HIDAMARI_WIDTH,
+		.height = HIDAMARI_HEIGHT,
+		.sample_size = sizeof(Sample),
+	};
+
+	if (writer->fp && 0 != fclose(writer->fp))
+		writer->error = true;
+	writer->fp = NULL;
+	memcpy(header.magic, SAMPLE_MAGIC, sizeof(header.magic));
+	for (;; ++writer->number) {
+		snprintf(path, sizeof(path), "%s-%06u.hds", writer->prefix,
+				writer->number);
+		/* Never write over the chunks of an earlier run */
+		writer->fp = fopen(path, "wbx");
+		if (writer->fp || EEXIST != errno)
+			break;
+	}
+	if (!writer->fp)
+		return -1;
+	writer->number += 1;
+	writer->in_chunk = 0;
+	if (1 != fwrite(&header, sizeof(header), 1, writer->fp))
+		return -1;
+	return 0;
+}
+
+SampleWriter *
+sample_writer_open(char const *prefix, size_t chunk)
+{
+	SampleWriter *writer;
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer)
+		return NULL;
+	writer->prefix = strdup(prefix);
+	writer->chunk = chunk ? chunk : 1;
+	if (!writer->prefix || 0 > next_chunk(writer)) {
+		if (writer->fp)
+			fclose(writer->fp);
+		free(writer->prefix);
+		free(writer);
+		return NULL;
+	}
+	pthread_mutex_init(&writer->lock, NULL);
+	return writer;
+}
+
+int
+sample_write(SampleWriter *writer, Sample const *sample, size_t n)
+{
+	int ret;
+	size_t m;
+
+	pthread_mutex_lock(&writer->lock);
+	while (n > 0 && !writer->error) {
+		if (writer->in_chunk == writer->chunk && 0 > next_chunk(writer)) {
+			writer->error = true;
+			break;
+		}
+		m = MIN(n, writer->chunk - writer->in_chunk);
+		if (m != fwrite(sample, sizeof(*sample), m, writer->fp))
+			writer->error = true;
+		writer->in_chunk += m;
+		sample += m;
+		n -= m;
+	}
+	/* Readers mapping the chunk see whole batches */
+	if (writer->fp && 0 != fflush(writer->fp))
+		writer->error = true;
+	ret = writer->error ? -1 : 0;
+	pthread_mutex_unlock(&writer->lock);
+	return ret;
+}
+
+int
+sample_writer_close(SampleWriter *writer)
+{
+	int ret;
+
+	ret = (writer->fp && 0 != fclose(writer->fp)) || writer->error ? -1 : 0;
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->prefix);
+	free(writer);
+	return ret;
+}
@@ -0,0 +1,77 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ai.h"
+#include "hidamari.h"
+
+/* Samples of the AI's decisions, for training evaluators offline. A sample
+ * is a position as the AI saw it, the placement it chose and the score of
+ * the search behind it.
+ *
+ * Samples are written to chunk files of a fixed number of samples each.
+ * A chunk is a SampleHeader followed by the samples back to back, in the
+ * byte order of the machine that wrote it. Chunks are only ever appended
+ * to, and the number of samples in one follows from its size, so a chunk
+ * can be mapped into memory even while it is being written. */
+
+#define SAMPLE_MAGIC "HDMSAMP1"
+
+/* The grid is HIDAMARI_HEIGHT rows of HIDAMARI_WIDTH bits, walls and floor
+ * included, packed back to back from the floor up. Bit x of a row, counted
+ * from the least significant bit of its first byte, is column x. */
+#define SAMPLE_GRID_BYTES ((HIDAMARI_WIDTH * HIDAMARI_HEIGHT + 7) / 8)
+
+typedef struct {
+	char magic[8];
+	u32 width; /* Board the samples were played on */
+	u32 height;
+	u32 sample_size; /* sizeof(Sample) */
+	u32 reserved;
+} SampleHeader;
+
+typedef struct {
+	f32 score; /* Search score of the choice, lower is better, NAN if
+	            * played from the book */
+	u8 shape; /* Current hidamari */
+	u8 next; /* Next hidamari */
+	u8 orientation; /* Placement of the current hidamari as it locks */
+	int8_t x;
+	u8 y;
+	u8 grid[SAMPLE_GRID_BYTES];
+} Sample;
+
+typedef struct SampleWriter SampleWriter;
+
+/* Make the sample of choosing _choice_ in the position _field_ */
+void
+sample_make(HidamariPlayField const *field, AIChoice const *choice,
+		Sample *sample);
+
+/* Start writing chunks of _chunk_ samples named <prefix>-000000.hds and
+ * on, from the first number that is not taken yet.
+ *
+ * Return: The writer, or NULL if the first chunk could not be made.
+ */
+SampleWriter *
+sample_writer_open(char const *prefix, size_t chunk);
+
+/* Append samples, starting new chunks as they fill. Any number of threads
+ * may write at once, and the samples of one call stay together in order.
+ *
+ * Return: 0 on success, -1 if a chunk could not be written.
+ */
+int
+sample_write(SampleWriter *writer, Sample const *sample, size_t n);
+
+/* Close the current chunk.
+ *
+ * Return: 0 if every sample was written, otherwise -1.
+ */
+int
+sample_writer_close(SampleWriter *writer);
+
+#endif
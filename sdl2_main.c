@@ -1,7 +1,9 @@
 /* See LICENSE file for copyright and license details */
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 #include <SDL2/SDL.h>
@@ -9,60 +11,223 @@
 #include <unistd.h>
 
 #include "ai.h"
+#include "compose.h"
 #include "hidamari.h"
+#include "input.h"
 #include "region.h"
+#include "spectate.h"
+#include "stats.h"
+#include "telemetry.h"
 
 #define TILE_S 16
+#define FRAME_PITCH (COMPOSE_WIDTH(TILE_S) * 4)
 
-void
-render(SDL_Renderer *renderer, SDL_Texture *texture, HidamariBuffer *buf)
+#define LEN(a) (sizeof(a) / sizeof(*(a)))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Repeat timings of held keys in nanoseconds: delayed auto-shift and
+ * auto-repeat rate of left and right, and the rate of soft drops */
+#define DAS (167 * 1000000ULL)
+#define ARR (33 * 1000000ULL)
+#define SDR (33 * 1000000ULL)
+
+/* Speeds cycled through with F4, in timesteps per frame, where 0 runs as
+ * many as fit in the frame. The game is drawn once per frame either way. */
+static size_t const turbo_speed[] = {1, 10, 100, 0};
+/* Timesteps run between checks of the clock in turbo mode */
+#define TURBO_BATCH 32
+
+/* Records of the games played, if kept */
+static StatsSink *sink;
+
+/* Quitting from the menu exits right away, so the records are written out
+ * on exit */
+static void
+close_stats(void)
 {
-	int i, j;
-	SDL_Rect src_r = {.h = TILE_S, .w = TILE_S, .x = 0, .y = 0};
-	SDL_Rect dest_r = {.h = TILE_S, .w = TILE_S, .x = 0, .y = 0};
-	char tile;
-	u8 *color;
+	stats_close(sink);
+}
 
-	SDL_RenderClear(renderer);
-	/* Render the static grid */
-	for (i = 0; i < HIDAMARI_BUFFER_WIDTH; ++i) {
-		for (j = 0; j < HIDAMARI_BUFFER_HEIGHT; ++j) {
+/* Export of the game to spectators, if any, removed on exit as well */
+static Spectate *spec;
 
-			tile = buf->tile[HIDAMARI_BUFFER_WIDTH - 1 - i][HIDAMARI_BUFFER_HEIGHT - 1 -j];
-			color = buf->color[HIDAMARI_BUFFER_WIDTH - 1 - i][HIDAMARI_BUFFER_HEIGHT - 1 -j];
+static void
+close_spectate(void)
+{
+	spectate_destroy(spec);
+}
 
-			// Set color
-			SDL_SetTextureColorMod(texture, color[0], color[1], color[2]);
+/* Record the game if the timesteps run since _state_ finished it */
+static void
+record_game(HidamariGame const *game, HidamariGameState state)
+{
+	StatsRecord record;
 
-			if (HIDAMARI_TILE_SPACE == tile)
-				continue;
+	if (sink && HIDAMARI_GS_GAME_PLAYING == state
+	    && HIDAMARI_GS_GAME_PLAYING != game->state) {
+		stats_record(game, &record);
+		stats_push(sink, &record);
+	}
+}
+
+/* Map a key to the button it controls */
+static Button
+key_button(SDL_Keycode key)
+{
+	switch (key) {
+	case SDLK_w:
+	case SDLK_k:
+	case SDLK_UP:
+		return BUTTON_UP;
+	case SDLK_s:
+	case SDLK_j:
+	case SDLK_DOWN:
+		return BUTTON_DOWN;
+	case SDLK_d:
+	case SDLK_l:
+	case SDLK_RIGHT:
+		return BUTTON_RIGHT;
+	case SDLK_a:
+	case SDLK_h:
+	case SDLK_LEFT:
+		return BUTTON_LEFT;
+	case SDLK_e:
+	case SDLK_i:
+	case SDLK_x:
+		return BUTTON_R;
+	case SDLK_q:
+	case SDLK_u:
+	case SDLK_z:
+	case SDLK_LCTRL:
+		return BUTTON_L;
+	case SDLK_RETURN:
+	case SDLK_SPACE:
+		return BUTTON_B;
+	default:
+		return BUTTON_NONE;
+	}
+}
+
+/* Compose the whole buffer in software and display it with one upload */
+void
+render(SDL_Renderer *renderer, SDL_Texture *frame,
+		ComposeTileset const *tileset, u8 *fb, HidamariBuffer *buf)
+{
+	compose(tileset, buf, fb, FRAME_PITCH);
+	SDL_UpdateTexture(frame, NULL, fb, FRAME_PITCH);
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, frame, NULL, NULL);
+}
+
+/* Draw a line of text with the tileset glyphs at half the tile size */
+static void
+draw_text(SDL_Renderer *renderer, SDL_Texture *texture, int x, int y, char const *str)
+{
+	int tile;
+	SDL_Rect src_r = {.h = TILE_S, .w = TILE_S, .x = 0, .y = 0};
+	SDL_Rect dest_r = {.h = TILE_S / 2, .w = TILE_S / 2, .x = x, .y = y};
 
-			dest_r.x = TILE_S * (HIDAMARI_BUFFER_WIDTH - 1 - i);
-			dest_r.y = TILE_S * j;
-			src_r.x = TILE_S * (tile % 16);
-			src_r.y = TILE_S * (tile / 16);
-			SDL_RenderCopy(renderer, texture, &src_r, &dest_r);
+	SDL_SetTextureColorMod(texture, 255, 255, 100);
+	for (; *str; ++str, dest_r.x += TILE_S / 2) {
+		if ('0' <= *str && *str <= '9') {
+			tile = *str - '0';
+		} else if ('A' <= *str && *str <= 'Z') {
+			tile = *str - ASCII_OFFSET;
+		} else {
+			continue;
 		}
+		src_r.x = TILE_S * (tile % 16);
+		src_r.y = TILE_S * (tile / 16);
+		SDL_RenderCopy(renderer, texture, &src_r, &dest_r);
 	}
+}
 
-	/* Background color */
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-	SDL_RenderPresent(renderer); 
+/* Draw the turbo speed and the timesteps and frames per second over the
+ * bottom left of the window */
+static void
+draw_rate(SDL_Renderer *renderer, SDL_Texture *texture, size_t speed,
+		unsigned tps, unsigned fps)
+{
+	int i;
+	char line[3][16];
+
+	if (speed > 0)
+		snprintf(line[0], sizeof(line[0]), "X%zu", speed);
+	else
+		snprintf(line[0], sizeof(line[0]), "MAX");
+	snprintf(line[1], sizeof(line[1]), "TPS %u", tps);
+	snprintf(line[2], sizeof(line[2]), "FPS %u", fps);
+	for (i = 0; i < 3; ++i) {
+		draw_text(renderer, texture, 2, TILE_S * HIDAMARI_BUFFER_HEIGHT
+				- (3 - i) * TILE_S * 3 / 4, line[i]);
+	}
+}
+
+/* Draw the performance counters over the left side of the window */
+static void
+draw_overlay(SDL_Renderer *renderer, SDL_Texture *texture)
+{
+	int i;
+	char line[8][16];
+	HidamariTelemetry t;
+	u64 *c = t.counter;
+
+	telemetry_read(&t);
+	snprintf(line[0], sizeof(line[0]), "PLAN %lluUS", (unsigned long long)
+			telemetry_quantile(&t.hist[TELEMETRY_HIST_PLAN_NS], 0.5) / 1000);
+	snprintf(line[1], sizeof(line[1]), "P99 %lluUS", (unsigned long long)
+			telemetry_quantile(&t.hist[TELEMETRY_HIST_PLAN_NS], 0.99) / 1000);
+	snprintf(line[2], sizeof(line[2]), "NPS %llu", (unsigned long long)
+			(c[TELEMETRY_PLAN_NS] ? c[TELEMETRY_NODES] * 1000000000.0 / c[TELEMETRY_PLAN_NS] : 0));
+	snprintf(line[3], sizeof(line[3]), "LPS %llu", (unsigned long long)
+			(c[TELEMETRY_PLAN_NS] ? c[TELEMETRY_LEAVES] * 1000000000.0 / c[TELEMETRY_PLAN_NS] : 0));
+	snprintf(line[4], sizeof(line[4]), "MEM %lluK", (unsigned long long)
+			c[TELEMETRY_REGION_BYTES] / 1024);
+	snprintf(line[5], sizeof(line[5]), "TPP %llu", (unsigned long long)
+			(c[TELEMETRY_PIECES] ? c[TELEMETRY_TICKS] / c[TELEMETRY_PIECES] : 0));
+	/* Lines cleared per minute of game time, at 60 timesteps a second */
+	snprintf(line[6], sizeof(line[6]), "LPM %llu", (unsigned long long)
+			(c[TELEMETRY_TICKS] ? c[TELEMETRY_LINES] * 3600 / c[TELEMETRY_TICKS] : 0));
+	snprintf(line[7], sizeof(line[7]), "DRAW %lluUS", (unsigned long long)
+			telemetry_quantile(&t.hist[TELEMETRY_HIST_FRAME_NS], 0.5) / 1000);
+	for (i = 0; i < 8; ++i) {
+		draw_text(renderer, texture, 2, 2 + i * TILE_S * 3 / 4, line[i]);
+	}
 }
 
 int
-main()
+main(int argc, char **argv)
 {
 	HidamariGame game;
+	HidamariBuffer buf;
+	HidamariAIConfig config;
 	uint32_t acc, dt;
 	uint32_t last = SDL_GetTicks();
 	uint32_t now;
 	uint32_t frame_time;
+	uint32_t deadline, draw_time = 0;
+	uint32_t rate_start = last;
+	u64 draw_start;
+	u64 n_tick = 0, n_frame = 0;
+	unsigned tps = 0, fps = 0;
+	bool overlay = false;
+	size_t turbo = 0;
+	size_t owed, n;
 	SDL_Window *screen;
 	SDL_Event event;
 	dt = 1000 / 60; /* miliseconds / frames */
 	acc = 0.0;
-	Button button = BUTTON_NONE;
+	Button button;
+	Button act[INPUT_TICK_MAX];
+	size_t n_act;
+	u64 tick_end;
+	InputRing ring;
+	InputState input;
+	ComposeTileset tileset;
+	u8 *fb;
+	int opt;
+	size_t len;
+	HidamariGameState state;
 
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		return EXIT_FAILURE;
@@ -85,9 +250,65 @@ main()
 	SDL_Surface *tileset_sf = IMG_Load("res/tileset/default.png");
 	SDL_Texture *tileset_hw = SDL_CreateTextureFromSurface(renderer,
 			tileset_sf);
+	/* The game is composed in software from its own copy of the tileset */
+	SDL_Surface *tileset_rgba = SDL_ConvertSurfaceFormat(tileset_sf,
+			SDL_PIXELFORMAT_RGBA32, 0);
+	if (NULL == tileset_rgba || 0 > compose_tileset_init(&tileset,
+			tileset_rgba->pixels, tileset_rgba->w, tileset_rgba->h,
+			tileset_rgba->pitch, TILE_S))
+		return 1;
+	SDL_FreeSurface(tileset_rgba);
+	SDL_Texture *frame = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+			SDL_TEXTUREACCESS_STREAMING, COMPOSE_WIDTH(TILE_S),
+			COMPOSE_HEIGHT(TILE_S));
+	fb = malloc(FRAME_PITCH * COMPOSE_HEIGHT(TILE_S));
+	if (NULL == frame || NULL == fb)
+		return 1;
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
 	srand(time(NULL));
-	hidamari_init(&game);
+	hidamari_init(&game, &buf);
+	input_ring_init(&ring);
+	input_init(&input, DAS, ARR, SDR);
+	/* Timesteps are timed from the start of the first frame, on the same
+	 * clock as the key events */
+	tick_end = (u64)last * 1000000;
+	/* Optionally record every game played and export it to spectators */
+	while (-1 != (opt = getopt(argc, argv, "s:x:"))) {
+		switch (opt) {
+		case 's':
+			len = strlen(optarg);
+			sink = stats_open(optarg, len > 4
+					&& 0 == strcmp(optarg + len - 4, ".csv")
+					? STATS_CSV : STATS_BINARY, 64);
+			if (!sink) {
+				fprintf(stderr, "error: Could not open %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			atexit(close_stats);
+			break;
+		case 'x':
+			spec = spectate_create(optarg, 1, SPECTATE_BUFFER);
+			if (!spec) {
+				fprintf(stderr, "error: Could not export to %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			atexit(close_spectate);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s stats file] [-x export name] "
+					"[weights file]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	/* Optionally use AI weights from a file instead of the presets */
+	if (optind < argc) {
+		if (0 > ai_config_load(&config, argv[optind])) {
+			fprintf(stderr, "error: Could not read AI weights from %s\n", argv[optind]);
+			return EXIT_FAILURE;
+		}
+		game.ai.config = &config;
+	}
 	for (;;) {
 		// Uncomment and change the number below to test lag!
 		//usleep(100000);
@@ -96,64 +317,88 @@ main()
 		last = now;
 		acc += frame_time;
 
-		while (acc >= dt) {
-			while (SDL_PollEvent(&event)) {      
-				switch (event.type) {
-				case SDL_QUIT:
-					goto endgame;
-				case SDL_KEYDOWN:
-					switch(event.key.keysym.sym) {
-					case SDLK_w:
-					case SDLK_k:
-					case SDLK_UP:
-						button = BUTTON_UP;
-						break;
-					case SDLK_s:
-					case SDLK_j:
-					case SDLK_DOWN:
-						button = BUTTON_DOWN;
-						break;
-					case SDLK_d:
-					case SDLK_l:
-					case SDLK_RIGHT:
-						button = BUTTON_RIGHT;
-						break;
-					case SDLK_a:
-					case SDLK_h:
-					case SDLK_LEFT:
-						button = BUTTON_LEFT;
-						break;
-					case SDLK_e:
-					case SDLK_i:
-					case SDLK_x:
-						button = BUTTON_R;
-						break;
-					case SDLK_q:
-					case SDLK_u:
-					case SDLK_z:
-					case SDLK_LCTRL:
-						button = BUTTON_L;
-						break;
-					case SDLK_RETURN:
-					case SDLK_SPACE:
-						button = BUTTON_B;
-						break;
-					default:
-						button = BUTTON_NONE;
-						break;
-					}
+		/* Queue every press and release with the time it happened */
+		while (SDL_PollEvent(&event)) {
+			switch (event.type) {
+			case SDL_QUIT:
+				goto endgame;
+			case SDL_KEYDOWN:
+				if (SDLK_F3 == event.key.keysym.sym && !event.key.repeat)
+					overlay = !overlay;
+				if (SDLK_F4 == event.key.keysym.sym && !event.key.repeat)
+					turbo = (turbo + 1) % LEN(turbo_speed);
+				/* Fall through */
+			case SDL_KEYUP:
+				/* Held keys are repeated by the input state */
+				if (event.key.repeat)
 					break;
-				}
+				button = key_button(event.key.keysym.sym);
+				if (BUTTON_NONE != button)
+					input_push(&ring, (u64)event.key.timestamp * 1000000,
+							button, SDL_KEYDOWN == event.type);
+				break;
 			}
-			hidamari_update(&game, button);
+		}
+		while (0 == turbo && acc >= dt) {
+			/* Perform the inputs up to the end of this timestep */
+			tick_end += (u64)dt * 1000000;
+			n_act = input_tick(&input, &ring, tick_end, act, LEN(act));
+			state = game.state;
+			hidamari_update_inputs(&game, act, n_act);
+			record_game(&game, state);
+			n_tick += 1;
 			acc -= dt;
-			button = BUTTON_NONE;
 		}
+		if (turbo > 0 && acc >= dt) {
+			/* The inputs of the whole frame go into its first
+			 * timestep, and the rest are run without drawing until
+			 * the frame is due, leaving time to draw it */
+			deadline = now + dt - MIN(draw_time, dt);
+			tick_end = (u64)now * 1000000;
+			n_act = input_tick(&input, &ring, tick_end, act, LEN(act));
+			state = game.state;
+			hidamari_update_inputs(&game, act, n_act);
+			record_game(&game, state);
+			n_tick += 1;
+			owed = turbo_speed[turbo] ? turbo_speed[turbo] * (acc / dt) - 1
+					: SIZE_MAX;
+			while (owed > 0 && SDL_GetTicks() < deadline) {
+				state = game.state;
+				n = hidamari_run(&game, NULL, MIN(owed, TURBO_BATCH));
+				record_game(&game, state);
+				n_tick += n;
+				owed -= n;
+			}
+			acc %= dt;
+		}
+		if (spec)
+			spectate_publish(spec, 0, &game);
 		// Sleep away some time to avoid wasting CPU cycles
-		usleep((dt - acc) * 1000);
-		render(renderer, tileset_hw, &game.buf);
+		now = SDL_GetTicks();
+		if (now - last < dt - acc)
+			usleep((dt - acc - (now - last)) * 1000);
+		/* Timesteps and frames per second, over the last second */
+		if (now - rate_start >= 1000) {
+			tps = n_tick * 1000 / (now - rate_start);
+			fps = n_frame * 1000 / (now - rate_start);
+			n_tick = n_frame = 0;
+			rate_start = now;
+		}
+		draw_start = telemetry_now();
+		render(renderer, frame, &tileset, fb, game.buf);
+		if (overlay)
+			draw_overlay(renderer, tileset_hw);
+		if (overlay || turbo > 0)
+			draw_rate(renderer, tileset_hw, turbo_speed[turbo], tps, fps);
+		telemetry_sample(TELEMETRY_HIST_FRAME_NS, telemetry_now() - draw_start);
+		SDL_RenderPresent(renderer);
+		draw_time = SDL_GetTicks() - now;
+		n_frame += 1;
 	}
 endgame:
+	free(fb);
+	compose_tileset_free(&tileset);
+	SDL_DestroyTexture(frame);
 	SDL_DestroyWindow(screen);
 	SDL_DestroyRenderer(renderer);
 }
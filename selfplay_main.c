@@ -0,0 +1,199 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "evalcache.h"
+#include "field.h"
+#include "hidamari.h"
+#include "region.h"
+#include "sample.h"
+
+/* Generate training samples from seeded AI self-play. Games are shared out
+ * among threads, each of which plays its games with a region and a batch
+ * of samples of its own, so memory use stays flat however long it runs.
+ * Game i is always played from seed + i, but the games of different
+ * threads reach the chunks in no particular order. */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Samples a thread collects before writing them out together */
+#define BATCH 1024
+#define THREADS_MAX 256
+
+typedef struct {
+	HidamariAIConfig const *config;
+	SampleWriter *writer;
+	size_t n_game;
+	u32 max_lines;
+	u32 seed;
+	_Atomic size_t next; /* Index of the next game to play */
+	_Atomic u64 samples;
+	_Atomic bool error;
+} SelfPlay;
+
+char *argv0;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-j threads] [-c chunk samples] "
+			"[-e cache entries] <prefix> [games] [lines] [seed] "
+			"[weights file]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+work(void *arg)
+{
+	size_t i, n = 0;
+	void *region;
+	Sample *batch;
+	AIChoice choice;
+	HidamariPlayField field;
+	SelfPlay *sp = arg;
+
+	region = region_borrow(ai_size_requirement());
+	batch = malloc(BATCH * sizeof(*batch));
+	if (!region || !batch) {
+		atomic_store(&sp->error, true);
+		goto done;
+	}
+	for (;;) {
+		i = atomic_fetch_add_explicit(&sp->next, 1, memory_order_relaxed);
+		if (i >= sp->n_game || atomic_load(&sp->error))
+			break;
+		field_init(&field, sp->seed + i);
+		while (field.lines < sp->max_lines) {
+			region_clear(region);
+			ai_choose(region, sp->config, &field, &choice);
+			sample_make(&field, &choice, &batch[n]);
+			if (BATCH == ++n) {
+				if (0 > sample_write(sp->writer, batch, n))
+					atomic_store(&sp->error, true);
+				atomic_fetch_add(&sp->samples, n);
+				n = 0;
+			}
+			if (HIDAMARI_GS_GAME_PLAYING
+			    != field_place(&field, &choice.placed))
+				break;
+		}
+	}
+	if (n > 0) {
+		if (0 > sample_write(sp->writer, batch, n))
+			atomic_store(&sp->error, true);
+		atomic_fetch_add(&sp->samples, n);
+	}
+done:
+	if (region)
+		region_return(region);
+	free(batch);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	size_t i, n_thread = 0, chunk = 1 << 20, n_started = 0;
+	double start, elapsed;
+	pthread_t thread[THREADS_MAX];
+	HidamariAIConfig config;
+	HidamariGame game;
+	SelfPlay sp = {
+		.config = &config,
+		.n_game = 100,
+		.max_lines = 1000,
+		.seed = 1,
+	};
+
+	argv0 = argv[0];
+	while (-1 != (opt = getopt(argc, argv, "j:c:e:"))) {
+		switch (opt) {
+		case 'j':
+			n_thread = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			chunk = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			/* Shared by every thread */
+			if (0 > evalcache_init(strtoull(optarg, NULL, 10))) {
+				fprintf(stderr, "error: Could not allocate the cache\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2 || argc > 6)
+		usage();
+	if (argc > 2)
+		sp.n_game = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		sp.max_lines = strtoul(argv[3], NULL, 10);
+	if (argc > 4)
+		sp.seed = strtoul(argv[4], NULL, 10);
+	if (argc > 5) {
+		if (0 > ai_config_load(&config, argv[5])) {
+			fprintf(stderr, "error: Could not read AI weights from %s\n", argv[5]);
+			return EXIT_FAILURE;
+		}
+	} else {
+		hidamari_init(&game, NULL);
+		config = *hidamari_ai_config(&game);
+	}
+	/* Planning threads are already one per CPU */
+	config.n_thread = 1;
+
+	sp.writer = sample_writer_open(argv[1], chunk);
+	if (!sp.writer) {
+		fprintf(stderr, "error: Could not write to %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (0 == n_thread)
+		n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+	n_thread = MIN(MIN(n_thread, THREADS_MAX), sp.n_game);
+	atomic_init(&sp.next, 0);
+	atomic_init(&sp.samples, 0);
+	atomic_init(&sp.error, false);
+
+	start = now();
+	/* Whatever threads cannot be started, the main one makes up for */
+	for (i = 1; i < n_thread; ++i) {
+		if (0 != pthread_create(&thread[n_started], NULL, work, &sp))
+			break;
+		n_started += 1;
+	}
+	work(&sp);
+	for (i = 0; i < n_started; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	elapsed = now() - start;
+
+	if (0 > sample_writer_close(sp.writer) || atomic_load(&sp.error)) {
+		fprintf(stderr, "error: Could not write all samples\n");
+		return EXIT_FAILURE;
+	}
+	printf("%llu samples from %zu games in %.3fs, %.0f samples/h\n",
+			(unsigned long long)atomic_load(&sp.samples), sp.n_game,
+			elapsed, atomic_load(&sp.samples) * 3600 / elapsed);
+	return 0;
+}
@@ -0,0 +1,236 @@
+/* See LICENSE file for copyright and license details */
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hidamari.h"
+#include "spectate.h"
+
+/* Frames in each ring. The writer fills the frame after the latest, so a
+ * reader copying the latest is only overtaken if this many are published
+ * meanwhile. */
+#define N_FRAME 4
+/* Slots and frames start on their own cache lines */
+#define LINE 64
+#define ALIGN(n) (((n) + LINE - 1) / LINE * LINE)
+
+typedef struct {
+	_Atomic u64 published; /* Frames published to the slot so far */
+} Slot;
+
+typedef struct {
+	_Atomic u64 seq; /* Odd while the frame is being written */
+	u8 data[];
+} Frame;
+
+struct Spectate {
+	u8 *map;
+	size_t size;
+	size_t frame_stride;
+	size_t slot_stride;
+	char *name; /* Removed on destroy, NULL for viewers */
+};
+
+static size_t
+frame_size(SpectateKind kind)
+{
+	return SPECTATE_BUFFER == kind ? sizeof(HidamariBuffer)
+		: sizeof(SpectateField);
+}
+
+static void
+layout(Spectate *spec, SpectateHeader const *header)
+{
+	spec->frame_stride = ALIGN(sizeof(Frame) + header->frame_size);
+	spec->slot_stride = ALIGN(sizeof(Slot))
+		+ header->n_frame * spec->frame_stride;
+	spec->size = ALIGN(sizeof(SpectateHeader))
+		+ header->n_game * spec->slot_stride;
+}
+
+static Slot *
+slot(Spectate const *spec, size_t i)
+{
+	return (Slot *)(spec->map + ALIGN(sizeof(SpectateHeader))
+			+ i * spec->slot_stride);
+}
+
+static Frame *
+frame(Spectate const *spec, Slot *s, u64 n)
+{
+	SpectateHeader const *header = spectate_header(spec);
+
+	return (Frame *)((u8 *)s + ALIGN(sizeof(Slot))
+			+ n % header->n_frame * spec->frame_stride);
+}
+
+Spectate *
+spectate_create(char const *name, size_t n_game, SpectateKind kind)
+{
+	int fd;
+	Spectate *spec;
+	SpectateHeader header = {
+		.magic = SPECTATE_MAGIC,
+		.width = HIDAMARI_WIDTH,
+		.height = HIDAMARI_HEIGHT,
+		.kind = kind,
+		.n_game = n_game,
+		.n_frame = N_FRAME,
+		.frame_size = frame_size(kind),
+	};
+
+	spec = calloc(1, sizeof(*spec));
+	if (!spec)
+		return NULL;
+	spec->name = strdup(name);
+	if (!spec->name) {
+		free(spec);
+		return NULL;
+	}
+	layout(spec, &header);
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (0 > fd)
+		goto fail;
+	/* The new object reads as zeroes: no frame published yet */
+	if (0 > ftruncate(fd, spec->size)) {
+		close(fd);
+		shm_unlink(name);
+		goto fail;
+	}
+	spec->map = mmap(NULL, spec->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (MAP_FAILED == spec->map) {
+		shm_unlink(name);
+		goto fail;
+	}
+	memcpy(spec->map, &header, sizeof(header));
+	return spec;
+fail:
+	free(spec->name);
+	free(spec);
+	return NULL;
+}
+
+void
+spectate_destroy(Spectate *spec)
+{
+	shm_unlink(spec->name);
+	spectate_close(spec);
+}
+
+void
+spectate_publish(Spectate *spec, size_t i, HidamariGame const *game)
+{
+	u64 n, seq;
+	Slot *s = slot(spec, i);
+	Frame *f;
+	SpectateField *snapshot;
+
+	if (SPECTATE_BUFFER == spectate_header(spec)->kind && !game->buf)
+		return;
+	/* Only this thread writes to the slot */
+	n = atomic_load_explicit(&s->published, memory_order_relaxed);
+	f = frame(spec, s, n);
+	seq = atomic_load_explicit(&f->seq, memory_order_relaxed);
+	atomic_store_explicit(&f->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	if (SPECTATE_BUFFER == spectate_header(spec)->kind) {
+		memcpy(f->data, game->buf, sizeof(*game->buf));
+	} else {
+		snapshot = (SpectateField *)f->data;
+		snapshot->state = game->state;
+		memcpy(&snapshot->field, &game->field, sizeof(game->field));
+	}
+	atomic_store_explicit(&f->seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&s->published, n + 1, memory_order_release);
+}
+
+Spectate *
+spectate_open(char const *name)
+{
+	int fd;
+	struct stat st;
+	SpectateHeader header;
+	Spectate *spec;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (0 > fd)
+		return NULL;
+	if (0 > fstat(fd, &st) || (size_t)st.st_size < sizeof(header)
+	    || sizeof(header) != pread(fd, &header, sizeof(header), 0)
+	    || 0 != memcmp(header.magic, SPECTATE_MAGIC, sizeof(header.magic))
+	    || HIDAMARI_WIDTH != header.width
+	    || HIDAMARI_HEIGHT != header.height
+	    || header.kind > SPECTATE_BUFFER
+	    || frame_size(header.kind) != header.frame_size
+	    || 0 == header.n_frame) {
+		close(fd);
+		return NULL;
+	}
+	spec = calloc(1, sizeof(*spec));
+	if (!spec) {
+		close(fd);
+		return NULL;
+	}
+	layout(spec, &header);
+	if ((size_t)st.st_size < spec->size) {
+		close(fd);
+		free(spec);
+		return NULL;
+	}
+	spec->map = mmap(NULL, spec->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == spec->map) {
+		free(spec);
+		return NULL;
+	}
+	return spec;
+}
+
+void
+spectate_close(Spectate *spec)
+{
+	munmap(spec->map, spec->size);
+	free(spec->name);
+	free(spec);
+}
+
+SpectateHeader const *
+spectate_header(Spectate const *spec)
+{
+	return (SpectateHeader const *)spec->map;
+}
+
+bool
+spectate_read(Spectate const *spec, size_t i, void *out, u64 *frame_no)
+{
+	int attempt;
+	u64 n, seq;
+	Slot *s = slot(spec, i);
+	Frame *f;
+
+	for (attempt = 0; attempt < 4; ++attempt) {
+		n = atomic_load_explicit(&s->published, memory_order_acquire);
+		if (0 == n)
+			return false;
+		f = frame(spec, s, n - 1);
+		seq = atomic_load_explicit(&f->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		memcpy(out, f->data, spectate_header(spec)->frame_size);
+		atomic_thread_fence(memory_order_acquire);
+		if (seq == atomic_load_explicit(&f->seq, memory_order_relaxed)) {
+			*frame_no = n;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,93 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* Live games exported to POSIX shared memory for other processes to watch.
+ *
+ * The shared object is a SpectateHeader followed by one slot per game. A
+ * slot holds the number of frames published to it so far and a ring of
+ * frames, each guarded by a sequence number that is odd while the frame
+ * is being written. Publishing a frame never waits for readers: it bumps
+ * the sequence, copies the frame in and bumps the sequence again. Readers
+ * copy the latest frame out and keep it only if its sequence was even and
+ * unchanged throughout, so a slow reader misses frames rather than slowing
+ * the game down.
+ *
+ * Frames are either whole HidamariBuffers, for a view of the game as it is
+ * drawn, or SpectateFields, small enough to publish every timestep of a
+ * headless game. Both are laid out as the writer compiled them, so viewers
+ * must be built for the same board. */
+
+#define SPECTATE_MAGIC "HDMSPEC1"
+
+typedef enum {
+	SPECTATE_FIELD,
+	SPECTATE_BUFFER,
+} SpectateKind;
+
+typedef struct {
+	char magic[8];
+	u32 width; /* Board of the games */
+	u32 height;
+	u32 kind; /* SpectateKind of the frames */
+	u32 n_game;
+	u32 n_frame; /* Frames in the ring of each game */
+	u32 frame_size; /* sizeof(SpectateField) or sizeof(HidamariBuffer) */
+} SpectateHeader;
+
+typedef struct {
+	HidamariGameState state;
+	HidamariPlayField field;
+} SpectateField;
+
+typedef struct Spectate Spectate;
+
+/* Create the shared object _name_, as for shm_open(), with a slot for each
+ * of _n_game_ games, replacing any left behind by an earlier export.
+ *
+ * Return: The export, or NULL if it could not be created.
+ */
+Spectate *
+spectate_create(char const *name, size_t n_game, SpectateKind kind);
+
+/* Unmap and remove the shared object. Viewers that have it mapped keep
+ * their last frames. */
+void
+spectate_destroy(Spectate *spec);
+
+/* Publish the current frame of _game_ to slot _i_. Only one thread may
+ * publish to a slot at a time. A buffer export skips games that are not
+ * drawn. */
+void
+spectate_publish(Spectate *spec, size_t i, HidamariGame const *game);
+
+/* Map the shared object _name_ made by spectate_create() for reading.
+ *
+ * Return: The export, or NULL if it does not exist or was made for
+ *	another board.
+ */
+Spectate *
+spectate_open(char const *name);
+
+void
+spectate_close(Spectate *spec);
+
+SpectateHeader const *
+spectate_header(Spectate const *spec);
+
+/* Copy the latest frame of slot _i_ to _frame_, frame_size bytes, and its
+ * number, counted from 1, to _frame_no_.
+ *
+ * Return: false if nothing has been published yet or every attempt was
+ *	overtaken by the writer.
+ */
+bool
+spectate_read(Spectate const *spec, size_t i, void *frame, u64 *frame_no);
+
+#endif
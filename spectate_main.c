@@ -0,0 +1,161 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "field.h"
+#include "hidamari.h"
+#include "spectate.h"
+
+/* A reference viewer for games exported with spectate.h. It maps the
+ * export read-only and draws the latest frame of one game as text, never
+ * holding up the process that plays it. */
+
+/* Interval between frames drawn */
+#define INTERVAL_NS (1000000000 / 30)
+
+char *argv0;
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-n frames] <name> [game]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+static void
+draw_field(SpectateField const *s)
+{
+	int x, y, i;
+	Vec2 cell[4];
+	char row[HIDAMARI_HEIGHT][HIDAMARI_WIDTH];
+	HidamariPlayField const *field = &s->field;
+
+	for (y = 0; y < HIDAMARI_HEIGHT; ++y) {
+		for (x = 0; x < HIDAMARI_WIDTH; ++x) {
+			if (!(field->grid[y] & (HidamariRow)1 << x))
+				row[y][x] = '.';
+			else if (0 == x || HIDAMARI_WIDTH - 1 == x || 0 == y)
+				row[y][x] = '|';
+			else
+				row[y][x] = '#';
+		}
+	}
+	if (HIDAMARI_GS_GAME_PLAYING == s->state) {
+		field_cells(&field->current, cell);
+		for (i = 0; i < 4; ++i) {
+			if (cell[i].x >= 0 && cell[i].x < HIDAMARI_WIDTH
+			    && cell[i].y >= 0 && cell[i].y < HIDAMARI_HEIGHT)
+				row[cell[i].y][cell[i].x] =
+					hidamari_shape_char[field->current.shape];
+		}
+	}
+	printf("score %u, lines %u, level %u, pieces %u, next %c%s\n",
+			field->score, field->lines, field->level, field->pieces,
+			hidamari_shape_char[field->next],
+			HIDAMARI_GS_GAME_OVER == s->state ? ", game over" : "");
+	for (y = HIDAMARI_HEIGHT - 1; y >= 0; --y) {
+		fwrite(row[y], 1, HIDAMARI_WIDTH, stdout);
+		putchar('\n');
+	}
+}
+
+static char
+tile_char(HidamariTile t)
+{
+	if (t <= HIDAMARI_TILE_9)
+		return '0' + t - HIDAMARI_TILE_0;
+	if (t >= HIDAMARI_TILE_CHAR_A && t <= HIDAMARI_TILE_CHAR_Z)
+		return 'A' + t - HIDAMARI_TILE_CHAR_A;
+	if (t >= HIDAMARI_TILE_I && t <= HIDAMARI_TILE_Z)
+		return hidamari_shape_char[t - HIDAMARI_TILE_I];
+	switch (t) {
+	case HIDAMARI_TILE_FALLEN:
+		return '#';
+	case HIDAMARI_TILE_WALL:
+	case HIDAMARI_TILE_PLAIN:
+		return '|';
+	default:
+		return ' ';
+	}
+}
+
+static void
+draw_buffer(HidamariBuffer const *buf)
+{
+	int x, y;
+
+	for (y = HIDAMARI_BUFFER_HEIGHT - 1; y >= 0; --y) {
+		for (x = 0; x < HIDAMARI_BUFFER_WIDTH; ++x) {
+			putchar(tile_char(buf->tile[x][y]));
+		}
+		putchar('\n');
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	size_t i = 0;
+	u64 n_frame = 0, frame_no, last = 0;
+	void *frame;
+	Spectate *spec;
+	SpectateHeader const *header;
+	struct timespec interval = { 0, INTERVAL_NS };
+
+	argv0 = argv[0];
+	while (-1 != (opt = getopt(argc, argv, "n:"))) {
+		switch (opt) {
+		case 'n':
+			n_frame = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2 || argc > 3)
+		usage();
+	if (argc > 2)
+		i = strtoul(argv[2], NULL, 10);
+
+	spec = spectate_open(argv[1]);
+	if (!spec) {
+		fprintf(stderr, "error: Could not open the export %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	header = spectate_header(spec);
+	if (i >= header->n_game) {
+		fprintf(stderr, "error: The export has only %u games\n",
+				header->n_game);
+		return EXIT_FAILURE;
+	}
+	frame = malloc(header->frame_size);
+	if (!frame)
+		return EXIT_FAILURE;
+	/* Frames that do not change, or that the writer overtakes, are not
+	 * drawn */
+	for (;;) {
+		if (spectate_read(spec, i, frame, &frame_no) && frame_no != last) {
+			/* Home the cursor and clear the screen */
+			printf("\033[H\033[2Jgame %zu, frame %llu\n", i,
+					(unsigned long long)frame_no);
+			if (SPECTATE_BUFFER == header->kind)
+				draw_buffer(frame);
+			else
+				draw_field(frame);
+			fflush(stdout);
+			last = frame_no;
+			if (n_frame > 0 && 0 == --n_frame)
+				break;
+		}
+		nanosleep(&interval, NULL);
+	}
+	free(frame);
+	spectate_close(spec);
+	return 0;
+}
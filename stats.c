@@ -0,0 +1,200 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hidamari.h"
+#include "stats.h"
+
+#define LEN(a) (sizeof(a) / sizeof(*(a)))
+
+/* Records are written out whole, so padding would leak stack bytes */
+_Static_assert(offsetof(StatsRecord, plan_ns) % _Alignof(u64) == 0
+		&& sizeof(StatsRecord) == offsetof(StatsRecord, plan_ns)
+		   + sizeof(u64), "a StatsRecord must have no padding");
+
+struct StatsSink {
+	FILE *fp;
+	int format;
+	bool error;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t added; /* Signalled when records are queued or closing */
+	pthread_cond_t taken; /* Signalled when the writer frees up space */
+	bool closing;
+	/* Ring of queued records */
+	size_t capacity;
+	StatsRecord *ring;
+	size_t head;
+	size_t len;
+	StatsRecord *batch; /* Records being written, outside the lock */
+};
+
+static int
+write_csv(FILE *fp, StatsRecord const *r)
+{
+	size_t i;
+
+	fprintf(fp, "%u,%u,%u,%u,%u,%u,%u", r->seed, r->ai, r->score,
+			r->lines, r->pieces, r->ticks, r->level);
+	for (i = 0; i < LEN(r->clears); ++i) {
+		fprintf(fp, ",%u", r->clears[i]);
+	}
+	for (i = 0; i < LEN(r->level_pieces); ++i) {
+		fprintf(fp, ",%u", r->level_pieces[i]);
+	}
+	return 0 > fprintf(fp, ",%u,%llu\n", r->plans,
+			(unsigned long long)r->plan_ns) ? -1 : 0;
+}
+
+static int
+write_header(FILE *fp, int format)
+{
+	size_t i;
+	u32 size = sizeof(StatsRecord);
+
+	if (STATS_BINARY == format) {
+		if (1 != fwrite(STATS_MAGIC, strlen(STATS_MAGIC), 1, fp)
+		    || 1 != fwrite(&size, sizeof(size), 1, fp))
+			return -1;
+		return 0;
+	}
+	fprintf(fp, "seed,ai,score,lines,pieces,ticks,level");
+	for (i = 1; i <= 4; ++i) {
+		fprintf(fp, ",clears%zu", i);
+	}
+	for (i = 1; i <= HIDAMARI_LEVEL_MAX; ++i) {
+		fprintf(fp, ",level%zu_pieces", i);
+	}
+	return 0 > fprintf(fp, ",plans,plan_ns\n") ? -1 : 0;
+}
+
+static void *
+work(void *arg)
+{
+	size_t i, n;
+	bool closing;
+	StatsSink *sink = arg;
+
+	pthread_mutex_lock(&sink->lock);
+	for (;;) {
+		while (!sink->closing && 0 == sink->len)
+			pthread_cond_wait(&sink->added, &sink->lock);
+		closing = sink->closing;
+		/* Take everything queued so far in one go */
+		for (n = 0; n < sink->len; ++n) {
+			sink->batch[n] = sink->ring[(sink->head + n) % sink->capacity];
+		}
+		sink->head = (sink->head + n) % sink->capacity;
+		sink->len = 0;
+		pthread_cond_broadcast(&sink->taken);
+		pthread_mutex_unlock(&sink->lock);
+
+		if (STATS_BINARY == sink->format) {
+			if (n != fwrite(sink->batch, sizeof(*sink->batch), n, sink->fp))
+				sink->error = true;
+		} else {
+			for (i = 0; i < n; ++i) {
+				if (0 > write_csv(sink->fp, &sink->batch[i]))
+					sink->error = true;
+			}
+		}
+
+		pthread_mutex_lock(&sink->lock);
+		if (closing && 0 == sink->len)
+			break;
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return NULL;
+}
+
+StatsSink *
+stats_open(char const *path, int format, size_t capacity)
+{
+	StatsSink *sink;
+
+	sink = calloc(1, sizeof(*sink));
+	if (!sink)
+		return NULL;
+	sink->format = format;
+	sink->capacity = capacity ? capacity : 1;
+	sink->ring = calloc(sink->capacity, sizeof(*sink->ring));
+	sink->batch = calloc(sink->capacity, sizeof(*sink->batch));
+	if (!sink->ring || !sink->batch)
+		goto fail;
+	sink->fp = fopen(path, STATS_BINARY == format ? "wb" : "w");
+	if (!sink->fp)
+		goto fail;
+	if (0 > write_header(sink->fp, format))
+		goto fail_file;
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->added, NULL);
+	pthread_cond_init(&sink->taken, NULL);
+	if (0 != pthread_create(&sink->writer, NULL, work, sink)) {
+		pthread_mutex_destroy(&sink->lock);
+		pthread_cond_destroy(&sink->added);
+		pthread_cond_destroy(&sink->taken);
+		goto fail_file;
+	}
+	return sink;
+fail_file:
+	fclose(sink->fp);
+fail:
+	free(sink->batch);
+	free(sink->ring);
+	free(sink);
+	return NULL;
+}
+
+int
+stats_close(StatsSink *sink)
+{
+	int ret;
+
+	pthread_mutex_lock(&sink->lock);
+	sink->closing = true;
+	pthread_cond_signal(&sink->added);
+	pthread_mutex_unlock(&sink->lock);
+	pthread_join(sink->writer, NULL);
+	ret = 0 != fclose(sink->fp) || sink->error ? -1 : 0;
+	pthread_mutex_destroy(&sink->lock);
+	pthread_cond_destroy(&sink->added);
+	pthread_cond_destroy(&sink->taken);
+	free(sink->batch);
+	free(sink->ring);
+	free(sink);
+	return ret;
+}
+
+void
+stats_record(HidamariGame const *game, StatsRecord *record)
+{
+	memset(record, 0, sizeof(*record));
+	record->seed = game->stats.seed;
+	record->score = game->field.score;
+	record->lines = game->field.lines;
+	record->pieces = game->field.pieces;
+	record->ticks = game->stats.ticks;
+	memcpy(record->clears, game->stats.clears, sizeof(record->clears));
+	memcpy(record->level_pieces, game->stats.level_pieces,
+			sizeof(record->level_pieces));
+	record->plans = game->stats.plans;
+	record->level = game->field.level;
+	record->ai = game->ai.active;
+	record->plan_ns = game->stats.plan_ns;
+}
+
+void
+stats_push(StatsSink *sink, StatsRecord const *record)
+{
+	pthread_mutex_lock(&sink->lock);
+	while (sink->len == sink->capacity)
+		pthread_cond_wait(&sink->taken, &sink->lock);
+	sink->ring[(sink->head + sink->len) % sink->capacity] = *record;
+	sink->len += 1;
+	pthread_cond_signal(&sink->added);
+	pthread_mutex_unlock(&sink->lock);
+}
@@ -0,0 +1,66 @@
+/* See LICENSE file for copyright and license details */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hidamari.h"
+
+/* A sink for one record per finished game, written to a file by a thread of
+ * its own so that the games never wait on the disk. Records queue in a ring
+ * of fixed capacity, and only when it is full does adding one block until
+ * the writer catches up.
+ *
+ * A binary file is the magic STATS_MAGIC, the size of a record as a u32,
+ * and then the records back to back, in the byte order of the machine that
+ * wrote it. A CSV file has a header line naming the columns. */
+
+#define STATS_MAGIC "HDMSTAT1"
+
+enum {
+	STATS_BINARY,
+	STATS_CSV,
+};
+
+typedef struct StatsSink StatsSink;
+
+typedef struct {
+	u32 seed;
+	u32 score;
+	u32 lines;
+	u32 pieces;
+	u32 ticks;
+	u32 clears[4]; /* Clears of one to four lines at once */
+	u32 level_pieces[HIDAMARI_LEVEL_MAX]; /* See HidamariGameStats */
+	u32 plans;
+	u8 level;
+	u8 ai; /* Played by the AI */
+	u8 reserved[6]; /* Zero, so that no byte is padding */
+	u64 plan_ns;
+} StatsRecord;
+
+/* Open a sink writing to _path_ in the given format, queueing at most
+ * _capacity_ records.
+ *
+ * Return: The sink, or NULL if the file or the writer could not be made.
+ */
+StatsSink *
+stats_open(char const *path, int format, size_t capacity);
+
+/* Write out every queued record, stop the writer and close the file.
+ *
+ * Return: 0 if every record was written, otherwise -1.
+ */
+int
+stats_close(StatsSink *sink);
+
+/* Make the record of a game that has ended */
+void
+stats_record(HidamariGame const *game, StatsRecord *record);
+
+/* Queue a record to be written. Any number of threads may add records. */
+void
+stats_push(StatsSink *sink, StatsRecord const *record);
+
+#endif
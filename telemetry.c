@@ -0,0 +1,81 @@
+/* See LICENSE file for copyright and license details */
+#include <stdatomic.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+#ifdef HIDAMARI_TELEMETRY
+
+_Atomic u64 telemetry_counter[TELEMETRY_COUNTER_LAST];
+_Atomic u64 telemetry_hist[TELEMETRY_HIST_LAST][TELEMETRY_BUCKETS + 3];
+
+void
+telemetry_read(HidamariTelemetry *out)
+{
+	size_t i, j;
+
+	for (i = 0; i < TELEMETRY_COUNTER_LAST; ++i) {
+		out->counter[i] = atomic_load_explicit(&telemetry_counter[i],
+				memory_order_relaxed);
+	}
+	for (i = 0; i < TELEMETRY_HIST_LAST; ++i) {
+		out->hist[i].count = atomic_load_explicit(&telemetry_hist[i][0],
+				memory_order_relaxed);
+		out->hist[i].sum = atomic_load_explicit(&telemetry_hist[i][1],
+				memory_order_relaxed);
+		out->hist[i].max = atomic_load_explicit(&telemetry_hist[i][2],
+				memory_order_relaxed);
+		for (j = 0; j < TELEMETRY_BUCKETS; ++j) {
+			out->hist[i].bucket[j] = atomic_load_explicit(
+					&telemetry_hist[i][3 + j],
+					memory_order_relaxed);
+		}
+	}
+}
+
+void
+telemetry_reset(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < TELEMETRY_COUNTER_LAST; ++i) {
+		atomic_store_explicit(&telemetry_counter[i], 0,
+				memory_order_relaxed);
+	}
+	for (i = 0; i < TELEMETRY_HIST_LAST; ++i) {
+		for (j = 0; j < TELEMETRY_BUCKETS + 3; ++j) {
+			atomic_store_explicit(&telemetry_hist[i][j], 0,
+					memory_order_relaxed);
+		}
+	}
+}
+
+#else
+
+void
+telemetry_read(HidamariTelemetry *out)
+{
+	memset(out, 0, sizeof(*out));
+}
+
+void
+telemetry_reset(void)
+{
+}
+
+#endif
+
+u64
+telemetry_quantile(TelemetryHist const *hist, double p)
+{
+	size_t i;
+	u64 seen = 0;
+	u64 rank = p * hist->count;
+
+	for (i = 0; i < TELEMETRY_BUCKETS; ++i) {
+		seen += hist->bucket[i];
+		if (seen > rank)
+			return i < 63 ? ((u64)1 << i) : hist->max;
+	}
+	return hist->max;
+}
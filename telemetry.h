@@ -0,0 +1,133 @@
+/* See LICENSE file for copyright and license details */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "type.h"
+
+/* Process-wide performance counters of the engine. They are only kept when
+ * compiled with HIDAMARI_TELEMETRY defined, otherwise recording compiles
+ * to nothing and telemetry_read() reports zeros. */
+
+#define TELEMETRY_BUCKETS 64
+
+enum {
+	TELEMETRY_PLANS, /* Calls to ai_plan() and ai_choose() */
+	TELEMETRY_NODES, /* Search nodes expanded */
+	TELEMETRY_LEAVES, /* Search leaves evaluated */
+	TELEMETRY_PRUNED, /* Search subtrees skipped by their bound */
+	TELEMETRY_MERGED, /* Search children repeating a sibling's placement */
+	TELEMETRY_PLAN_NS, /* Total time spent planning */
+	TELEMETRY_REGION_BYTES, /* Most bytes of a region used by one plan */
+	TELEMETRY_TICKS, /* Timesteps played, counted as each hidamari locks */
+	TELEMETRY_PIECES, /* Hidamaries locked */
+	TELEMETRY_LINES, /* Lines cleared */
+	TELEMETRY_PLAYOUTS, /* Monte Carlo playouts run by the planner */
+	TELEMETRY_INPUTS_DROPPED, /* Player inputs lost to a full queue */
+	TELEMETRY_BOOK_HITS, /* Plans taken from the opening book */
+	TELEMETRY_PC_PLANS, /* Plans towards a perfect clear */
+	TELEMETRY_CACHE_HITS, /* Plans taken from the evaluation cache */
+	TELEMETRY_COUNTER_LAST,
+};
+
+enum {
+	TELEMETRY_HIST_PLAN_NS, /* Latency of each plan */
+	TELEMETRY_HIST_PIECE_TICKS, /* Timesteps each hidamari was in play */
+	TELEMETRY_HIST_FRAME_NS, /* Time to draw each displayed frame */
+	TELEMETRY_HIST_LAST,
+};
+
+/* A histogram with power-of-two buckets: bucket i counts the samples
+ * below 2^i that are not counted in a lower bucket. */
+typedef struct {
+	u64 count;
+	u64 sum;
+	u64 max;
+	u64 bucket[TELEMETRY_BUCKETS];
+} TelemetryHist;
+
+typedef struct {
+	u64 counter[TELEMETRY_COUNTER_LAST];
+	TelemetryHist hist[TELEMETRY_HIST_LAST];
+} HidamariTelemetry;
+
+/* Take a snapshot of every counter and histogram */
+void
+telemetry_read(HidamariTelemetry *out);
+
+/* Zero every counter and histogram */
+void
+telemetry_reset(void);
+
+/* Estimate the _p_th quantile (0 to 1) of a histogram, as the upper bound
+ * of the bucket it falls in */
+u64
+telemetry_quantile(TelemetryHist const *hist, double p);
+
+#ifdef HIDAMARI_TELEMETRY
+
+extern _Atomic u64 telemetry_counter[TELEMETRY_COUNTER_LAST];
+/* Each histogram is stored as its count, sum and max followed by buckets */
+extern _Atomic u64 telemetry_hist[TELEMETRY_HIST_LAST][TELEMETRY_BUCKETS + 3];
+
+/* Monotonic time in nanoseconds */
+static inline u64
+telemetry_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+telemetry_count(int counter, u64 n)
+{
+	atomic_fetch_add_explicit(&telemetry_counter[counter], n,
+			memory_order_relaxed);
+}
+
+static inline void
+telemetry_raise(_Atomic u64 *cell, u64 v)
+{
+	u64 old = atomic_load_explicit(cell, memory_order_relaxed);
+
+	while (old < v && !atomic_compare_exchange_weak_explicit(cell, &old, v,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/* Raise a counter to _v_ if it is lower */
+static inline void
+telemetry_peak(int counter, u64 v)
+{
+	telemetry_raise(&telemetry_counter[counter], v);
+}
+
+static inline void
+telemetry_sample(int hist, u64 v)
+{
+	int i = v ? 64 - __builtin_clzll(v) : 0;
+	_Atomic u64 *h = telemetry_hist[hist];
+
+	atomic_fetch_add_explicit(&h[0], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h[1], v, memory_order_relaxed);
+	telemetry_raise(&h[2], v);
+	if (i >= TELEMETRY_BUCKETS)
+		i = TELEMETRY_BUCKETS - 1;
+	atomic_fetch_add_explicit(&h[3 + i], 1, memory_order_relaxed);
+}
+
+#else
+
+#define telemetry_now() ((u64)0)
+#define telemetry_count(counter, n) ((void)(counter), (void)(n))
+#define telemetry_peak(counter, v) ((void)(counter), (void)(v))
+#define telemetry_sample(hist, v) ((void)(hist), (void)(v))
+
+#endif
+
+#endif
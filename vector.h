@@ -2,11 +2,72 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
-#include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define VEC_ZERO {0, 0, NULL}
+#include "region.h"
+#include "type.h"
+
+/* Type specialised containers, instantiated by macro:
+ *
+ * VECTOR_INSTANTIATE(NAME, T, ALLOC) makes NAME, a growable array of T.
+ *
+ * HASHMAP_INSTANTIATE(NAME, K, V, HASH, EQUAL, ALLOC) makes NAME, a map from
+ * K to V with open addressing and linear probing. HASH(key) gives a u64 and
+ * EQUAL(a, b) compares two keys. Removed entries leave tombstones behind,
+ * which are compacted away when they make up much of the table.
+ *
+ * ALLOC names a pair of functions ALLOC_realloc(ctx, p, old, n) and
+ * ALLOC_free(ctx, p, n), passed the context the container was set up with.
+ * vec_heap uses malloc and ignores the context, while vec_region allocates
+ * from the region given as context and never frees, so containers built
+ * during a search go away with one region_clear(). */
+
+#define VEC_ZERO {0, 0, NULL, NULL}
+#define HASHMAP_ZERO {0, 0, 0, NULL, NULL, NULL, NULL}
+
+/* States of a hash map slot */
+enum {
+	HT_FREE,
+	HT_USED,
+	HT_TOMB,
+};
+
+static inline void *
+vec_heap_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+	(void)ctx;
+	(void)old;
+	return realloc(p, n);
+}
+
+static inline void
+vec_heap_free(void *ctx, void *p, size_t n)
+{
+	(void)ctx;
+	(void)n;
+	free(p);
+}
+
+static inline void *
+vec_region_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+	void *ret = region_alloc(ctx, n);
+
+	if (ret && p)
+		memcpy(ret, p, old < n ? old : n);
+	return ret;
+}
+
+static inline void
+vec_region_free(void *ctx, void *p, size_t n)
+{
+	(void)ctx;
+	(void)p;
+	(void)n;
+}
 
 #define VECTOR_INSTANTIATE(NAME, T, ALLOC) \
 typedef struct NAME NAME; \
@@ -14,44 +75,243 @@ struct NAME { \
 	size_t len; \
 	size_t size; \
 	T *data; \
+	void *ctx; /* Passed to the allocator */ \
 }; \
 \
+static inline void \
+NAME ## _init(NAME *vec, void *ctx) \
+{ \
+	vec->len = 0; \
+	vec->size = 0; \
+	vec->data = NULL; \
+	vec->ctx = ctx; \
+} \
+\
+static inline void \
+NAME ## _free(NAME *vec) \
+{ \
+	ALLOC ## _free(vec->ctx, vec->data, vec->size * sizeof(T)); \
+	NAME ## _init(vec, vec->ctx); \
+} \
+\
+/* Make room for at least _n_ elements. Return: 0, or -1 if out of memory */ \
 static inline int \
-NAME ## _push(NAME *table, T elem) \
+NAME ## _reserve(NAME *vec, size_t n) \
 { \
+	T *data; \
+	\
+	if (n <= vec->size) \
+		return 0; \
+	if (n > SIZE_MAX / sizeof(T)) \
+		return -1; \
+	data = ALLOC ## _realloc(vec->ctx, vec->data, vec->size * sizeof(T), \
+			n * sizeof(T)); \
+	if (!data) \
+		return -1; \
+	vec->data = data; \
+	vec->size = n; \
+	return 0; \
+} \
+\
+/* Return: 0, or -1 if out of memory */ \
+static inline int \
+NAME ## _push(NAME *vec, T elem) \
+{ \
+	if (vec->len == vec->size \
+	    && 0 > NAME ## _reserve(vec, vec->size ? 2 * vec->size : 16)) \
+		return -1; \
+	vec->data[vec->len++] = elem; \
+	return 0; \
 } \
 \
 static inline T \
-NAME ## _peek(NAME *table) \
+NAME ## _peek(NAME const *vec) \
 { \
+	return vec->data[vec->len - 1]; \
 } \
+\
 static inline T \
-NAME ## _pop(NAME *table) \
+NAME ## _pop(NAME *vec) \
+{ \
+	return vec->data[--vec->len]; \
+}
+
+#define HASHMAP_INSTANTIATE(NAME, K, V, HASH, EQUAL, ALLOC) \
+typedef struct NAME NAME; \
+struct NAME { \
+	size_t size; /* Slots, a power of two */ \
+	size_t used; /* Slots holding an entry or a tombstone */ \
+	size_t tombed; /* Slots holding a tombstone */ \
+	u8 *state; \
+	K *key; \
+	V *val; \
+	void *ctx; /* Passed to the allocator */ \
+}; \
+\
+static inline void \
+NAME ## _init(NAME *map, void *ctx) \
+{ \
+	memset(map, 0, sizeof(*map)); \
+	map->ctx = ctx; \
+} \
+\
+static inline void \
+NAME ## _free(NAME *map) \
+{ \
+	ALLOC ## _free(map->ctx, map->state, map->size); \
+	ALLOC ## _free(map->ctx, map->key, map->size * sizeof(K)); \
+	ALLOC ## _free(map->ctx, map->val, map->size * sizeof(V)); \
+	NAME ## _init(map, map->ctx); \
+} \
+\
+static inline size_t \
+NAME ## _len(NAME const *map) \
+{ \
+	return map->used - map->tombed; \
+} \
+\
+/* Slot of _key_, or else the first free slot on its probe sequence, or the \
+ * first tombstone on it if _tomb_ is set */ \
+static inline size_t \
+NAME ## _slot(NAME const *map, K key, bool tomb) \
+{ \
+	size_t mask = map->size - 1; \
+	size_t i = HASH(key) & mask; \
+	size_t first = SIZE_MAX; \
+	\
+	for (;; i = (i + 1) & mask) { \
+		if (HT_FREE == map->state[i]) \
+			return SIZE_MAX == first ? i : first; \
+		if (HT_TOMB == map->state[i]) { \
+			if (tomb && SIZE_MAX == first) \
+				first = i; \
+		} else if (EQUAL(map->key[i], key)) { \
+			return i; \
+		} \
+	} \
+} \
+\
+/* Rehash into _n_ slots, a power of two, dropping every tombstone. \
+ * Return: 0, or -1 if out of memory */ \
+static inline int \
+NAME ## _rehash(NAME *map, size_t n) \
+{ \
+	size_t i, j; \
+	NAME new; \
+	\
+	NAME ## _init(&new, map->ctx); \
+	new.state = ALLOC ## _realloc(map->ctx, NULL, 0, n); \
+	new.key = ALLOC ## _realloc(map->ctx, NULL, 0, n * sizeof(K)); \
+	new.val = ALLOC ## _realloc(map->ctx, NULL, 0, n * sizeof(V)); \
+	new.size = n; \
+	if (!new.state || !new.key || !new.val) { \
+		NAME ## _free(&new); \
+		return -1; \
+	} \
+	memset(new.state, HT_FREE, n); \
+	for (i = 0; i < map->size; ++i) { \
+		if (HT_USED != map->state[i]) \
+			continue; \
+		j = NAME ## _slot(&new, map->key[i], false); \
+		new.state[j] = HT_USED; \
+		new.key[j] = map->key[i]; \
+		new.val[j] = map->val[i]; \
+		new.used += 1; \
+	} \
+	NAME ## _free(map); \
+	*map = new; \
+	return 0; \
+} \
+\
+/* Make room for _n_ entries without rehashing. \
+ * Return: 0, or -1 if out of memory */ \
+static inline int \
+NAME ## _reserve(NAME *map, size_t n) \
 { \
+	size_t size = 16; \
+	\
+	/* Keep the table at most three quarters full */ \
+	while (size / 4 * 3 < n) \
+		size *= 2; \
+	return size > map->size ? NAME ## _rehash(map, size) : 0; \
 } \
 \
+/* Return: The value of _key_, or NULL if there is none */ \
 static inline V * \
-NAME ## _get(NAME *table, K key) \
+NAME ## _find(NAME const *map, K key) \
 { \
+	size_t i; \
+	\
+	if (0 == map->size) \
+		return NULL; \
+	i = NAME ## _slot(map, key, false); \
+	return HT_USED == map->state[i] ? &map->val[i] : NULL; \
 } \
 \
-static inline NAME * \
-NAME ## _grow(NAME *table, size_t n) \
+/* Return: The value of _key_, added zeroed if there was none, or NULL if \
+ *	out of memory. _added_, if given, is set if it was added. */ \
+static inline V * \
+NAME ## _get(NAME *map, K key, bool *added) \
+{ \
+	size_t i, n; \
+	\
+	if (added) \
+		*added = false; \
+	if ((map->used + 1) * 4 > map->size * 3) { \
+		/* Compact at the same size if half the taken slots are \
+		 * tombstones, otherwise grow */ \
+		n = map->size ? 2 * map->size : 16; \
+		if (map->size && map->tombed * 2 >= map->used) \
+			n = map->size; \
+		if (0 > NAME ## _rehash(map, n)) \
+			return NULL; \
+	} \
+	i = NAME ## _slot(map, key, true); \
+	if (HT_USED == map->state[i]) \
+		return &map->val[i]; \
+	if (HT_TOMB == map->state[i]) { \
+		map->tombed -= 1; \
+	} else { \
+		map->used += 1; \
+	} \
+	map->state[i] = HT_USED; \
+	map->key[i] = key; \
+	memset(&map->val[i], 0, sizeof(V)); \
+	if (added) \
+		*added = true; \
+	return &map->val[i]; \
+} \
+\
+/* Return: true if _key_ was there to remove */ \
+static inline bool \
+NAME ## _remove(NAME *map, K key) \
 { \
 	size_t i; \
-	NAME *new; \
 	\
-	/* Cannot resize without losing elements */ \
-	if (table->used - table->tombed > n) \
-		return table; \
-	new = NAME ## _create(n); \
-	for (i = 0; i < table->size; ++i) { \
-		if (HT_USED != table->state[i]) \
+	if (0 == map->size) \
+		return false; \
+	i = NAME ## _slot(map, key, false); \
+	if (HT_USED != map->state[i]) \
+		return false; \
+	map->state[i] = HT_TOMB; \
+	map->tombed += 1; \
+	return true; \
+} \
+\
+/* Step _i_, starting from 0, through the entries. \
+ * Return: false once there are no more */ \
+static inline bool \
+NAME ## _next(NAME const *map, size_t *i, K *key, V **val) \
+{ \
+	for (; *i < map->size; ++*i) { \
+		if (HT_USED != map->state[*i]) \
 			continue; \
-		* NAME ## _get(new, table->key[i]) = table->val[i]; \
+		*key = map->key[*i]; \
+		*val = &map->val[*i]; \
+		++*i; \
+		return true; \
 	} \
-	NAME ## _destroy(table); \
-	return new; \
+	return false; \
 }
 
 #endif